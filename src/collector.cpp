@@ -1,10 +1,46 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <thread>
 #include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
+#include <vector>
 
+#include <mapbox/variant.hpp>
 
-#define MAX_STACK 256
+
+#define STACK_SEGMENT 256
+#define HANDLE_CHUNK 256
 #define MAX_BARRIER 8
+#define MAX_CONCURRENT 2
+#define MAX_DEFERRALS 2
+#define STICKY_FULL_EVERY 8
+#define CHUNK_SIZE (64 * 1024)
+#define COMPRESSED_HEAP (16ull << 30)
+#define LARGE_OBJECT (8 * 1024)
+#define LARGE_TRIGGER (8 * 1024 * 1024)
+#define MARK_SLICE 256
+#define ZCT_BATCH 1024
+#define PRETENURE_SAMPLES 64
+#define PRETENURE_SURVIVAL 90
 
 void my_assert(int condition, const char* message) {
   if (!condition) {
@@ -20,236 +56,3889 @@ void my_assert(int condition, const char* message) {
    Libstdc++ version 4, part of the C++ 2017 standard.
 */
 
-class Object {
+/* Chunks come from here.  Normally that's just the C library.  With
+   COMPRESSED_REFS, every chunk in the process is carved out of one
+   COMPRESSED_HEAP reservation made up front, so that any object can be
+   named by its offset from the reservation's base in 32 bits.  Pages
+   are only committed as chunks are handed out, and chunks handed back
+   are decommitted and kept for reuse. */
+
+#ifdef COMPRESSED_REFS
+class ChunkSpace {
+public:
+  static ChunkSpace& global() {
+    static ChunkSpace space;
+    return space;
+  }
+
+  void* map() {
+    std::lock_guard<std::mutex> guard(lock);
+    char* chunk;
+    if (!released.empty()) {
+      chunk = released.back();
+      released.pop_back();
+    } else {
+      my_assert(used + CHUNK_SIZE <= COMPRESSED_HEAP, "Compressed heap exhausted!");
+      chunk = reinterpret_cast<char*>(base) + used;
+      used += CHUNK_SIZE;
+    }
+    my_assert(mprotect(chunk, CHUNK_SIZE, PROT_READ | PROT_WRITE) == 0, "Out of memory!");
+    return chunk;
+  }
+
+  void unmap(void *chunk) {
+    std::lock_guard<std::mutex> guard(lock);
+    madvise(chunk, CHUNK_SIZE, MADV_DONTNEED);
+    mprotect(chunk, CHUNK_SIZE, PROT_NONE);
+    released.push_back(static_cast<char*>(chunk));
+  }
+
+  uintptr_t base;
+
+private:
+  /* The reservation itself is aligned to CHUNK_SIZE by asking for one
+     chunk too many and starting at the first boundary inside it. */
+  ChunkSpace(): used(0) {
+    void* reserved = mmap(NULL, COMPRESSED_HEAP + CHUNK_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    my_assert(reserved != MAP_FAILED, "Couldn't reserve the compressed heap!");
+    base = (reinterpret_cast<uintptr_t>(reserved) + CHUNK_SIZE - 1) & ~(uintptr_t) (CHUNK_SIZE - 1);
+  }
+
+  std::mutex lock;
+  std::vector<char*> released;
+  size_t used;
+};
+
+const uintptr_t heapBase = ChunkSpace::global().base;
+
+inline void* mapChunk() {
+  return ChunkSpace::global().map();
+}
+
+inline void unmapChunk(void *chunk) {
+  ChunkSpace::global().unmap(chunk);
+}
+#else
+inline void* mapChunk() {
+  return std::aligned_alloc(CHUNK_SIZE, CHUNK_SIZE);
+}
+
+inline void unmapChunk(void *chunk) {
+  std::free(chunk);
+}
+#endif
+
+/* A Ref is how one object, or a stack slot, refers to another.  It
+   converts to and from Object* on its own, so code reading a pair's
+   fields doesn't need to know which kind it has.  Normally it simply
+   is an Object*.  With COMPRESSED_REFS it's a 32-bit offset from the
+   reservation's base, scaled by four: objects are 8-aligned, so the
+   low bit of the scaled offset is still clear, which leaves room for
+   immediates (see Object below) to keep theirs, in 31 bits.  That
+   caps the heap at 16GB.  Zero is null; no object lives at the base,
+   which is always a chunk header. */
+
+class Object;
+
+#ifdef COMPRESSED_REFS
+class Ref {
+public:
+  Ref(Object *o = NULL): bits(encode(o)) {};
+
+  operator Object*() const {
+    return decode(bits);
+  }
+
+  Object* operator->() const {
+    return decode(bits);
+  }
+
+private:
+  static uint32_t encode(Object *o) {
+    uintptr_t p = reinterpret_cast<uintptr_t>(o);
+    if (!p || (p & 1)) {
+      return static_cast<uint32_t>(p);
+    }
+    return static_cast<uint32_t>((p - heapBase) >> 2);
+  }
+
+  static Object* decode(uint32_t bits) {
+    if (bits & 1) {
+      return reinterpret_cast<Object*>(static_cast<intptr_t>(static_cast<int32_t>(bits)));
+    }
+    if (!bits) {
+      return NULL;
+    }
+    return reinterpret_cast<Object*>(heapBase + (static_cast<uintptr_t>(bits) << 2));
+  }
+
+  uint32_t bits;
+};
+#else
+typedef Object* Ref;
+#endif
+
+/* Payloads that don't have a fixed size live outside the chunks
+   altogether, each in a store of its own; an object only holds a
+   pointer to its store.  The bytes follow the header. */
+
+struct Store {
+  size_t size;
+  size_t hash;
+  bool marked;
+  bool mapped;
+  bool immortal;
+
+  char* bytes() {
+    return reinterpret_cast<char*>(this + 1);
+  }
+};
+
+/* An Object is nothing but its value.  Mark bits live in the bitmaps
+   of the chunk it was allocated from, and the heap is walked chunk by
+   chunk rather than down a list, so there's no header at all: a pair
+   is two pointers and the variant's index, 24 bytes, or 16 with
+   compressed references. */
+
+class alignas(8) Object {
 public:
-  unsigned char marked;
-  Object *next;
-  Object(int v): marked(0), value(v) {}
+  Object(int v): value(v) {}
   // Variant<Pair> uses move semantics; this doesn't result in Pair being built twice.
-  Object(Object* head, Object* tail): marked(0), value(Pair(head, tail)) {}
+  Object(Object* head, Object* tail): value(Pair(head, tail)) {}
 
   class Pair {
   public:
     Pair(Object* h, Object* t): head(h), tail(t) {};
-    Object* head;
-    Object* tail;
+    Ref head;
+    Ref tail;
+  };
+
+  /* A mutable run of bytes, which the collector never looks inside. */
+  struct Blob {
+    Store* store;
+
+    char* data() const {
+      return store->bytes();
+    }
+
+    size_t size() const {
+      return store->size;
+    }
+  };
+
+  /* A fixed-length run of references, kept contiguously in a store
+     rather than strung out over pairs. */
+  struct Vector {
+    Store* store;
+
+    Ref* elements() const {
+      return reinterpret_cast<Ref*>(store->bytes());
+    }
+
+    size_t size() const {
+      return store->size / sizeof(Ref);
+    }
   };
 
+  /* Immutable bytes.  Since nobody can write to them, strings with
+     the same contents can share a store without anyone noticing. */
+  struct String {
+    Store* store;
+
+    const char* data() const {
+      return store->bytes();
+    }
+
+    size_t size() const {
+      return store->size;
+    }
+  };
+
+  /* Refers to its target without keeping it alive.  Once the target
+     is collected the reference reads as null. */
+  struct Weak {
+    Ref target;
+  };
+
+  /* An ephemeron table: a map from keys, by identity, to values, in
+     which an entry only keeps its value alive for as long as something
+     else keeps its key alive.  The entries are open-addressed in a
+     store, behind a count; the capacity is a power of two, and never
+     more than half used. */
+  struct Table {
+    Store* store;
+
+    struct Entry {
+      Ref key;
+      Ref value;
+    };
+
+    size_t& count() const {
+      return *reinterpret_cast<size_t*>(store->bytes());
+    }
+
+    Entry* entries() const {
+      return reinterpret_cast<Entry*>(store->bytes() + sizeof(size_t));
+    }
+
+    size_t capacity() const {
+      return (store->size - sizeof(size_t)) / sizeof(Entry);
+    }
+
+    static size_t bytes(size_t capacity) {
+      return sizeof(size_t) + capacity * sizeof(Entry);
+    }
+
+    /* The key's entry, or the empty one where it would go. */
+    Entry* find(Object *key) const {
+      size_t mask = capacity() - 1;
+      size_t i = (reinterpret_cast<uintptr_t>(key) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+      for (;; i = (i + 1) & mask) {
+        Entry* entry = entries() + i;
+        if ((Object*) entry->key == key || !(Object*) entry->key) {
+          return entry;
+        }
+      }
+    }
+  };
+
+  Object(Blob blob): value(blob) {}
+  Object(Vector vector): value(vector) {}
+  Object(String string): value(string) {}
+  Object(Weak weak): value(weak) {}
+  Object(Table table): value(table) {}
+
   /* This is mostly an exploration of a discriminated union, and
      making one work in the context of a primitive but functional
      garbage collector. */
-  std::variant<int, Pair> value;
-};
+  std::variant<int, Pair, Blob, Vector, String, Weak, Table> value;
 
-class VM {
-public:
-  /* Imagine my surprise when I learned that clang doesn't bother to
-     zero out memory allocated on the threadstack. */
-  VM(): stackSize(0), numObjects(0), maxObjects(MAX_BARRIER), root(NULL) {};
-  
-  Object* pop() {
-    my_assert(stackSize > 0, "Stack underflow!");
-    return stack[--stackSize];
+  /* The variant's index, by name.  These must follow the order of the
+     alternatives above. */
+  enum Kind { INT, PAIR, BLOB, VECTOR, STRING, WEAK, TABLE };
+
+  Kind kind() const {
+    return static_cast<Kind>(value.index());
   }
 
-  /* This is basically the interface for a very primitive reverse
-     polish notation calculator of some kind.  A garbage-collected
-     Forth interpreter, perhaps. */
+  /* Objects are always at least pointer-aligned, so the low bit of a
+     real Object* is always clear.  A small integer can ride in a
+     pointer's place with that bit set instead, and never touch the
+     heap at all.  Anything that might hold one has to check before
+     dereferencing. */
+  static bool isImmediate(const Object *o) {
+    return reinterpret_cast<uintptr_t>(o) & 1;
+  }
 
-  Object* push(int v) {
-    return _push(insert(new Object(v)));
+  static bool fitsImmediate(int v) {
+#ifdef COMPRESSED_REFS
+    return v >= INT_MIN / 2 && v <= INT_MAX / 2;
+#else
+    return sizeof(intptr_t) > sizeof(int) || (v >= INT_MIN / 2 && v <= INT_MAX / 2);
+#endif
   }
-  
-  Object* push() {
-    return _push(insert(new Object(pop(), pop())));
+
+  static Object* immediate(int v) {
+    return reinterpret_cast<Object*>((static_cast<uintptr_t>(static_cast<intptr_t>(v)) << 1) | 1);
   }
 
-  /* Lambda-style visitors, enabling descent. */
-  void mark(Object *o) {
-    if (o->marked) {
-      return;
+  /* Works on both kinds of integer. */
+  static int toInt(const Object *o) {
+    if (isImmediate(o)) {
+      return static_cast<int>(reinterpret_cast<intptr_t>(o) >> 1);
     }
-
-    o->marked = 1;
-    return std::visit([this](auto &&arg) {
-        using T = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_same_v<T, int>) { }
-        else if constexpr (std::is_same_v<T, Object::Pair>) {
-            this->mark(arg.head);
-            this->mark(arg.tail);
-          }
-      }, o->value);
+    return std::get<int>(o->value);
   }
+};
 
-  /* So named because each scope resembles a collection of objects
-     leading horizontally from the vertical stack, creating a spine. */
-  void markSpine() {
-    for(auto i = 0; i < stackSize; i++) {
-      mark(stack[i]);
+#ifdef COMPRESSED_REFS
+static_assert(sizeof(Object) <= 16, "A compressed pair should fit in 16 bytes.");
+#else
+static_assert(sizeof(Object) <= 24, "A pair should fit in 24 bytes.");
+#endif
+
+/* Objects are carved out of CHUNK_SIZE chunks aligned to their own
+   size, so the chunk holding any address is just that address with the
+   low bits masked off.  Each chunk keeps a bitmap with a bit set for
+   every cell that holds an object, which is both how the allocator
+   finds a free cell and how a conservative scan tells a real object
+   from a word that only looks like a pointer to one.  Alongside it
+   are the mark bits, the bits that say an old object is already in
+   the remembered set, the bits that say a pair can't be changed, and
+   the bits that say an object has a finalizer.  The sweep looks at
+   those last ones a word at a time like everything else, so objects
+   without finalizers cost it nothing more than an AND.
+
+   A VM keeps two heaps.  Objects that can't hold a pointer, which so
+   far means boxed integers, go in a leaf heap of their own.  Marking
+   one is only setting its bit; the marker can tell from the chunk
+   header, which it reads anyway to find the bit, that there's nothing
+   inside to trace, so the object itself is never loaded.  Sweeping a
+   leaf chunk never touches the cells either.
+
+   There are two ways to take a cell.  allocate() is first fit over
+   the bitmaps, and reuses every hole a sweep leaves.  bump() never
+   looks back: each chunk has a top, everything past it has never
+   been handed out, and a cell is just the next one up.  It gives up
+   the holes until a chunk empties out entirely.
+
+   Sweeping can also wait.  deferSweep() only counts the dead and
+   leaves each chunk pending; a pending chunk is swept the first time
+   either allocator comes to it, and whatever is still pending is
+   finished off before the marks are next needed.
+
+   A heap can also keep a reference count per cell, for the VM's
+   reference counting mode.  The counts are an array hung off the chunk
+   rather than part of its header, so chunks of a heap that doesn't
+   count don't pay for them.  The top bit of a count says the object is
+   in the VM's zero count table; a count of PINNED never changes.
+   Allocation sites are kept the same way, for pretenuring: an id per
+   cell, whose top bit says the object hasn't been through a
+   collection yet.
+
+   Immortal cells are marked and stay that way: clearing the marks,
+   or sweeping without sticky marks, leaves the marks of the immortals
+   set, so tracing stops at them and sweeping passes them by.
+
+   A region's heaps are heaps like any other, except that their chunks
+   say so.  When the region ends they are either handed back whole, or
+   adopted, chunks and all, by the VM's main heaps. */
+
+const uint32_t IN_ZCT = 1u << 31;
+const uint32_t PINNED = IN_ZCT - 1;
+const uint32_t UNJUDGED = 1u << 31;
+
+const size_t CHUNK_WORDS = CHUNK_SIZE / sizeof(Object) / 64 + 1;
+
+struct Chunk {
+  uint64_t starts[CHUNK_WORDS];
+  uint64_t marks[CHUNK_WORDS];
+  uint64_t remembers[CHUNK_WORDS];
+  uint64_t immutables[CHUNK_WORDS];
+  uint64_t finalizables[CHUNK_WORDS];
+  uint64_t immortals[CHUNK_WORDS];
+  uint32_t* counts;
+  uint32_t* sites;
+  size_t cursor;
+  size_t top;
+  size_t index;
+  bool leaf;
+  bool region;
+  bool pending;
+};
+
+const size_t CHUNK_HEADER = (sizeof(Chunk) + alignof(Object) - 1) & ~(alignof(Object) - 1);
+const size_t CHUNK_CELLS = (CHUNK_SIZE - CHUNK_HEADER) / sizeof(Object);
+const size_t CHUNK_USED_WORDS = (CHUNK_CELLS + 63) / 64;
+
+class Heap {
+public:
+  Heap(bool leaf = false, bool region = false):
+    lo(UINTPTR_MAX), hi(0), leaf(leaf), region(region), counted(false), sited(false),
+    current(0), pending(0), pendingSticky(false) {};
+
+  ~Heap() {
+    for (auto chunk : chunks) {
+      for (size_t w = 0; w < CHUNK_USED_WORDS; w++) {
+        destroy(chunk, w, chunk->starts[w]);
+      }
+      delete[] chunk->counts;
+      delete[] chunk->sites;
+      unmapChunk(chunk);
     }
   }
 
-  void collect() {
-    int num = numObjects;
-    markSpine();
-    sweep();
-    maxObjects = numObjects * 2;
-#ifdef DEBUG
-    std::cout << "Collected " << (num - numObjects) << " objects, "
-              << numObjects << " remain." << std::endl;
-#endif
+  /* First fit, starting from the lowest chunk anything has been freed
+     into.  The cell comes back raw; the caller constructs into it. */
+  void* allocate() {
+    for (; current < chunks.size(); current++) {
+      if (void* cell = take(ready(chunks[current]))) {
+        return cell;
+      }
+    }
+    grow();
+    return take(chunks[current]);
   }
 
-  /* The saddest fact: I went with using NULL as our end-of-stack
-     discriminator rather than something higher-level, like an
-     Optional or Either-variant, because to use those I'd have to use
-     recursion to sweep the interpreter's stack, which means I'm at
-     the mercy of the C stack, complete with the cost of the unwind at
-     the end.  Bummer. */
+  void* bump() {
+    for (; current < chunks.size(); current++) {
+      Chunk* chunk = ready(chunks[current]);
+      if (chunk->top < CHUNK_CELLS) {
+        size_t i = chunk->top++;
+        chunk->starts[i / 64] |= 1ull << (i % 64);
+        return cells(chunk) + i;
+      }
+    }
+    grow();
+    return bump();
+  }
 
-  /* I look at this and ask, WWHSD?  What Would Herb Sutter Do? */
-  
-  void sweep() {
-    Object** o = &root;
-    while(*o) {
-      if (!(*o)->marked) {
-        Object* unreached = *o;
-        *o = unreached->next;
-        numObjects--;
-        delete unreached;
-      } else {
-        (*o)->marked = 0;
-        o = &(*o)->next;
+  void free(Object *o) {
+    Chunk* chunk = chunkOf(o);
+    size_t i = o - cells(chunk);
+    uint64_t bit = 1ull << (i % 64);
+    chunk->starts[i / 64] &= ~bit;
+    chunk->marks[i / 64] &= ~bit;
+    chunk->remembers[i / 64] &= ~bit;
+    chunk->immutables[i / 64] &= ~bit;
+    chunk->finalizables[i / 64] &= ~bit;
+    if (chunk->counts) {
+      chunk->counts[i] = 0;
+    }
+    if (chunk->sites) {
+      chunk->sites[i] = 0;
+    }
+    if (i + 1 == chunk->top) {
+      size_t w = i / 64 + 1;
+      while (w > 0 && !chunk->starts[w - 1]) {
+        w--;
       }
+      chunk->top = w ? w * 64 - __builtin_clzll(chunk->starts[w - 1]) : 0;
     }
+    chunk->cursor = std::min(chunk->cursor, i / 64);
+    current = std::min(current, chunk->index);
   }
-      
-  int numObjects;
-  
-private:
 
-  /* Heh.  Typo, "Stark overflow."  I'll just leave Tony right there anyway... */
-  Object* _push(Object *o) {
-    my_assert(stackSize < MAX_STACK, "Stark overflow");
-    stack[stackSize++] = o;
-    return o;
+  /* True only for the call that actually set the bit. */
+  static bool mark(const Object *o) {
+    return setBit(chunkOf(o)->marks, o);
   }
-  
-  Object* insert(Object *o) {
-    if (numObjects >= maxObjects) {
-      collect();
-    }
-    
-    o->marked = 0;
-    o->next = root;
-    root = o;
-    numObjects++;
-    return o;
+
+  static bool isLeaf(const Object *o) {
+    return chunkOf(o)->leaf;
   }
-    
-  Object* stack[MAX_STACK];
-  Object* root;
-  int stackSize;
-  int maxObjects;
-};
 
+  static bool inRegion(const Object *o) {
+    return chunkOf(o)->region;
+  }
 
-void test1() {
-  std::cout << "Test 1: Objects on stack are preserved." << std::endl;
-  VM vm;
-  vm.push(1);
-  vm.push(2);
-  vm.collect();
-  my_assert(vm.numObjects == 2, "Should have preserved objects.");
-}
+  static bool isMarked(const Object *o) {
+    return testBit(chunkOf(o)->marks, o);
+  }
 
-void test2() {
-  std::cout << "Test 2: Unreached objects are collected." << std::endl;
-  VM vm;
-  vm.push(1);
-  vm.push(2);
-  vm.pop();
-  vm.pop();
-  vm.collect();
-  my_assert(vm.numObjects == 0, "Should have collected objects.");
+  static bool remember(const Object *o) {
+    return setBit(chunkOf(o)->remembers, o);
+  }
 
-}
-    
-void test3() {
-  std::cout << "Test 3: Reach nested objects." << std::endl;
-  VM vm;
-  vm.push(1);
-  vm.push(2);
-  vm.push();
-  vm.push(3);
-  vm.push(4);
-  vm.push();
-  vm.push();
-  vm.collect();
-  my_assert(vm.numObjects == 7, "Should have reached objects.");
-}
+  static void setImmutable(const Object *o) {
+    setBit(chunkOf(o)->immutables, o);
+  }
 
-/* see: "Everything you need to know about std::variant from C++17, by Bartłomiej Filipek
-         https://www.bfilipek.com/2018/06/variant.html
-   Bartek says:
+  static void setFinalizable(const Object *o) {
+    setBit(chunkOf(o)->finalizables, o);
+  }
 
-   "Those two lines look like a bit of magic :) But all they do is they
-   create a struct that inherits all given lambdas and uses their
-   Ts::operator(). The whole structure can be now passed to std::visit."
+  static bool isFinalizable(const Object *o) {
+    return testBit(chunkOf(o)->finalizables, o);
+  }
 
-   As I understand it, the ellipsis there is the "Parameter Pack"
-   operator, used to define variadic types.  
+  /* True only for the call that made it immortal. */
+  static bool setImmortal(const Object *o) {
+    setBit(chunkOf(o)->marks, o);
+    return setBit(chunkOf(o)->immortals, o);
+  }
 
-*/         
+  static bool isImmortal(const Object *o) {
+    return testBit(chunkOf(o)->immortals, o);
+  }
 
-template<class... Ts> struct overload : Ts... { using Ts::operator()...; };
-template<class... Ts> overload(Ts...) -> overload<Ts...>;
+  static void unmark(const Object *o) {
+    Chunk* chunk = chunkOf(o);
+    size_t i = o - cells(chunk);
+    chunk->marks[i / 64] &= ~(1ull << (i % 64));
+  }
 
-void tail_setter(std::variant<int, Object::Pair> &c, Object *tail) {
-  std::visit(
-            overload{
-                     [&tail](int i) {},
-                     [&tail](Object::Pair &p) { p.tail = tail; }
-            }, c);
-}
+  static uint32_t& count(const Object *o) {
+    Chunk* chunk = chunkOf(o);
+    return chunk->counts[o - cells(chunk)];
+  }
 
-void test4() {
-  std::cout << "Test 4: Handle cycles." << std::endl;
-  VM vm;
-  vm.push(1);
-  vm.push(2);
-  Object* a = vm.push();
-  vm.push(3);
-  vm.push(4);
-  Object* b = vm.push();
-  
-  
-  tail_setter(a->value, b);
-  tail_setter(b->value, a);
-  vm.collect();
-  my_assert(vm.numObjects == 4, "Should have collected objects.");
-}
+  /* Counts start at zero, here and in every chunk from now on. */
+  void setCounted() {
+    counted = true;
+    for (auto chunk : chunks) {
+      if (!chunk->counts) {
+        chunk->counts = new uint32_t[CHUNK_CELLS]();
+      }
+    }
+  }
 
-void perfTest() {
-  std::cout << "Performance Test." << std::endl;
-  VM vm;
+  void clearCounts() {
+    for (auto chunk : chunks) {
+      memset(chunk->counts, 0, CHUNK_CELLS * sizeof(uint32_t));
+    }
+  }
 
-  for (int i = 0; i < 1000; i++) {
-    for (int j = 0; j < 20; j++) {
-      vm.push(i);
+  void setSited() {
+    sited = true;
+    for (auto chunk : chunks) {
+      if (!chunk->sites) {
+        chunk->sites = new uint32_t[CHUNK_CELLS]();
+      }
     }
+  }
 
-    for (int k = 0; k < 20; k++) {
-      vm.pop();
+  /* Only objects in a heap that keeps sites get one. */
+  static void setSite(const Object *o, uint32_t site) {
+    Chunk* chunk = chunkOf(o);
+    if (chunk->sites) {
+      chunk->sites[o - cells(chunk)] = site | UNJUDGED;
     }
   }
-}
 
-int main(int argc, const char * argv[]) {
+  /* Calls f(site, survived) for every object that hasn't been through
+     a collection before, going by the marks. */
+  template<typename F> void judge(F f) {
+    for (auto chunk : chunks) {
+      if (!chunk->sites) {
+        continue;
+      }
+      for (size_t i = 0; i < CHUNK_CELLS; i++) {
+        uint32_t &site = chunk->sites[i];
+        if (site & UNJUDGED) {
+          site &= ~UNJUDGED;
+          f(site, (chunk->marks[i / 64] >> (i % 64)) & 1);
+        }
+      }
+    }
+  }
+
+  template<typename F> void eachMarked(F f) {
+    for (auto chunk : chunks) {
+      for (size_t w = 0; w < CHUNK_USED_WORDS; w++) {
+        for (uint64_t bits = chunk->marks[w]; bits; bits &= bits - 1) {
+          f(cells(chunk) + w * 64 + __builtin_ctzll(bits));
+        }
+      }
+    }
+  }
+
+  static bool isImmutable(const Object *o) {
+    return testBit(chunkOf(o)->immutables, o);
+  }
+
+  static bool isRemembered(const Object *o) {
+    return testBit(chunkOf(o)->remembers, o);
+  }
+
+  static void forget(const Object *o) {
+    Chunk* chunk = chunkOf(o);
+    size_t i = o - cells(chunk);
+    chunk->remembers[i / 64] &= ~(1ull << (i % 64));
+  }
+
+  void clearMarks() {
+    finishSweep();
+    for (auto chunk : chunks) {
+      memcpy(chunk->marks, chunk->immortals, sizeof(chunk->marks));
+      memset(chunk->remembers, 0, sizeof(chunk->remembers));
+    }
+  }
+
+  /* Whatever is allocated but not marked is dead, a word at a time.
+     Only the dead cells themselves get touched, and only if an Object
+     has a destructor worth running.  Chunks left empty go back to the
+     system, all but one. */
+  size_t sweep(bool sticky) {
+    size_t freed = 0;
+    for (size_t c = 0; c < chunks.size(); ) {
+      freed += sweep(chunks[c], sticky);
+      if (chunks[c]->top == 0 && chunks.size() > 1) {
+        release(c);
+      } else {
+        c++;
+      }
+    }
+    current = 0;
+    return freed;
+  }
+
+  /* Counts what a sweep would free, without freeing it yet. */
+  size_t deferSweep(bool sticky) {
+    size_t dead = 0;
+    for (auto chunk : chunks) {
+      for (size_t w = 0; w < CHUNK_USED_WORDS; w++) {
+        dead += __builtin_popcountll(chunk->starts[w] & ~chunk->marks[w]);
+        condemn(chunk, w);
+      }
+      chunk->pending = true;
+    }
+    pending = chunks.size();
+    pendingSticky = sticky;
+    current = 0;
+    return dead;
+  }
+
+  /* Only the chunks still pending: one the allocator has already come
+     to holds new objects, unmarked but alive. */
+  void finishSweep() {
+    if (!pending) {
+      return;
+    }
+    for (size_t c = 0; c < chunks.size(); ) {
+      bool swept = chunks[c]->pending;
+      if (swept) {
+        sweep(chunks[c], pendingSticky);
+      }
+      if (swept && chunks[c]->top == 0 && chunks.size() > 1) {
+        release(c);
+      } else {
+        c++;
+      }
+    }
+    current = 0;
+  }
+
+  size_t size() const {
+    return chunks.size();
+  }
+
+  /* Takes over every chunk of another heap, objects and all. */
+  void adopt(Heap &other) {
+    finishSweep();
+    other.finishSweep();
+    for (auto chunk : other.chunks) {
+      chunk->region = region;
+      chunk->index = chunks.size();
+      chunks.push_back(chunk);
+      byAddress.insert(std::upper_bound(byAddress.begin(), byAddress.end(), chunk), chunk);
+      lo = std::min(lo, reinterpret_cast<uintptr_t>(chunk));
+      hi = std::max(hi, reinterpret_cast<uintptr_t>(chunk) + CHUNK_SIZE);
+    }
+    other.forget();
+  }
+
+  /* Frees everything at once, without looking at a mark bit.  Objects
+     with finalizers still go on the doomed list.  Returns how many
+     objects there were.  A lazy sweep still pending is finished first,
+     since it has already counted its dead. */
+  size_t releaseAll() {
+    finishSweep();
+    size_t freed = 0;
+    for (auto chunk : chunks) {
+      for (size_t w = 0; w < CHUNK_USED_WORDS; w++) {
+        uint64_t finalizable = chunk->finalizables[w] & chunk->starts[w];
+        for (; finalizable; finalizable &= finalizable - 1) {
+          doomed.push_back(cells(chunk) + w * 64 + __builtin_ctzll(finalizable));
+        }
+        freed += __builtin_popcountll(chunk->starts[w]);
+        destroy(chunk, w, chunk->starts[w]);
+      }
+      delete[] chunk->counts;
+      delete[] chunk->sites;
+      unmapChunk(chunk);
+    }
+    forget();
+    return freed;
+  }
+
+  /* The object whose cell contains p, if there is one.  Interior
+     pointers count, since an optimizer is free to keep one of those
+     instead of a pointer to the start. */
+  Object* find(uintptr_t p) const {
+    if (p < lo || p >= hi) {
+      return NULL;
+    }
+    Chunk* chunk = reinterpret_cast<Chunk*>(p & ~(uintptr_t) (CHUNK_SIZE - 1));
+    if (!std::binary_search(byAddress.begin(), byAddress.end(), chunk)) {
+      return NULL;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(cells(chunk));
+    if (p < base || (p - base) / sizeof(Object) >= CHUNK_CELLS) {
+      return NULL;
+    }
+    size_t i = (p - base) / sizeof(Object);
+    if (!(chunk->starts[i / 64] & (1ull << (i % 64)))) {
+      return NULL;
+    }
+    return cells(chunk) + i;
+  }
+
+  /* Bounds over every chunk, for a quick first filter. */
+  uintptr_t lo;
+  uintptr_t hi;
+
+  /* Dead objects with finalizers, found by the last sweep, or the
+     last deferSweep(), for the VM to collect. */
+  std::vector<Object*> doomed;
+
+private:
+  static Object* cells(Chunk *chunk) {
+    return reinterpret_cast<Object*>(reinterpret_cast<char*>(chunk) + CHUNK_HEADER);
+  }
+
+  static Object* cells(const Chunk *chunk) {
+    return cells(const_cast<Chunk*>(chunk));
+  }
+
+  static Chunk* chunkOf(const Object *o) {
+    return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(o) & ~(uintptr_t) (CHUNK_SIZE - 1));
+  }
+
+  static bool setBit(uint64_t *bits, const Object *o) {
+    size_t i = o - cells(chunkOf(o));
+    uint64_t bit = 1ull << (i % 64);
+    if (bits[i / 64] & bit) {
+      return false;
+    }
+    bits[i / 64] |= bit;
+    return true;
+  }
+
+  static bool testBit(const uint64_t *bits, const Object *o) {
+    size_t i = o - cells(chunkOf(o));
+    return bits[i / 64] & (1ull << (i % 64));
+  }
+
+  size_t sweep(Chunk *chunk, bool sticky) {
+    size_t freed = 0;
+    uint64_t any = 0;
+    for (size_t w = 0; w < CHUNK_USED_WORDS; w++) {
+      uint64_t dead = chunk->starts[w] & ~chunk->marks[w];
+      freed += __builtin_popcountll(dead);
+      condemn(chunk, w);
+      destroy(chunk, w, dead);
+      if (chunk->counts) {
+        for (uint64_t bits = dead; bits; bits &= bits - 1) {
+          chunk->counts[w * 64 + __builtin_ctzll(bits)] = 0;
+        }
+      }
+      chunk->starts[w] &= chunk->marks[w];
+      chunk->immutables[w] &= chunk->marks[w];
+      if (!sticky) {
+        chunk->marks[w] = chunk->immortals[w];
+      }
+      any |= chunk->starts[w];
+    }
+    chunk->cursor = 0;
+    if (!any) {
+      chunk->top = 0;
+    }
+    if (chunk->pending) {
+      chunk->pending = false;
+      pending--;
+    }
+    return freed;
+  }
+
+  void condemn(Chunk *chunk, size_t w) {
+    uint64_t bits = chunk->finalizables[w] & chunk->starts[w] & ~chunk->marks[w];
+    if (!bits) {
+      return;
+    }
+    chunk->finalizables[w] &= ~bits;
+    for (; bits; bits &= bits - 1) {
+      doomed.push_back(cells(chunk) + w * 64 + __builtin_ctzll(bits));
+    }
+  }
+
+  Chunk* ready(Chunk *chunk) {
+    if (chunk->pending) {
+      sweep(chunk, pendingSticky);
+    }
+    return chunk;
+  }
+
+  static void destroy(Chunk *chunk, size_t w, uint64_t bits) {
+    if (std::is_trivially_destructible<Object>::value || chunk->leaf) {
+      return;
+    }
+    for (; bits; bits &= bits - 1) {
+      cells(chunk)[w * 64 + __builtin_ctzll(bits)].~Object();
+    }
+  }
+
+  void release(size_t c) {
+    Chunk* chunk = chunks[c];
+    byAddress.erase(std::lower_bound(byAddress.begin(), byAddress.end(), chunk));
+    chunks[c] = chunks.back();
+    chunks[c]->index = c;
+    chunks.pop_back();
+    delete[] chunk->counts;
+    delete[] chunk->sites;
+    unmapChunk(chunk);
+    lo = reinterpret_cast<uintptr_t>(byAddress.front());
+    hi = reinterpret_cast<uintptr_t>(byAddress.back()) + CHUNK_SIZE;
+  }
+
+  void* take(Chunk *chunk) {
+    for (; chunk->cursor * 64 < CHUNK_CELLS; chunk->cursor++) {
+      uint64_t open = ~chunk->starts[chunk->cursor];
+      size_t left = CHUNK_CELLS - chunk->cursor * 64;
+      if (left < 64) {
+        open &= (1ull << left) - 1;
+      }
+      if (open) {
+        size_t bit = __builtin_ctzll(open);
+        size_t i = chunk->cursor * 64 + bit;
+        chunk->starts[chunk->cursor] |= 1ull << bit;
+        chunk->top = std::max(chunk->top, i + 1);
+        return cells(chunk) + i;
+      }
+    }
+    return NULL;
+  }
+
+  void forget() {
+    chunks.clear();
+    byAddress.clear();
+    lo = UINTPTR_MAX;
+    hi = 0;
+    current = 0;
+    pending = 0;
+  }
+
+  void grow() {
+    Chunk* chunk = static_cast<Chunk*>(mapChunk());
+    my_assert(chunk != NULL, "Out of memory!");
+    memset(chunk, 0, sizeof(Chunk));
+    chunk->index = chunks.size();
+    chunk->leaf = leaf;
+    chunk->region = region;
+    if (counted) {
+      chunk->counts = new uint32_t[CHUNK_CELLS]();
+    }
+    if (sited) {
+      chunk->sites = new uint32_t[CHUNK_CELLS]();
+    }
+    chunks.push_back(chunk);
+    byAddress.insert(std::upper_bound(byAddress.begin(), byAddress.end(), chunk), chunk);
+    lo = std::min(lo, reinterpret_cast<uintptr_t>(chunk));
+    hi = std::max(hi, reinterpret_cast<uintptr_t>(chunk) + CHUNK_SIZE);
+    current = chunk->index;
+  }
+
+  const bool leaf;
+  const bool region;
+  bool counted;
+  bool sited;
+  std::vector<Chunk*> chunks;
+  std::vector<Chunk*> byAddress;
+  size_t current;
+  size_t pending;
+  bool pendingSticky;
+};
+
+/* The large-object space keeps the stores.  One big enough to reach
+   LARGE_OBJECT gets pages of its own straight from mmap, so it never
+   sits in the middle of anything else and goes straight back to the
+   system the collection it dies in; smaller ones come from malloc.
+   Either way the store is on one list, with its mark bit in its
+   header, and it never moves.  A store is marked when the object
+   holding it is traced, and swept with the heaps.
+
+   A handful of objects can hold any number of bytes here, so the VM
+   counts the bytes toward a collection as well as the objects: it
+   collects once they reach twice what survived the last collection,
+   or LARGE_TRIGGER, whichever is more. */
+
+class LargeSpace {
+public:
+  LargeSpace(): bytes(0) {};
+
+  ~LargeSpace() {
+    for (auto store : stores) {
+      release(store);
+    }
+  }
+
+  /* Comes back zeroed. */
+  Store* allocate(size_t size) {
+    Store* store;
+    if (sizeof(Store) + size >= LARGE_OBJECT) {
+      void* pages = mmap(NULL, extent(size), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      store = pages == MAP_FAILED ? NULL : static_cast<Store*>(pages);
+    } else {
+      store = static_cast<Store*>(calloc(1, sizeof(Store) + size));
+    }
+    my_assert(store != NULL, "Out of memory!");
+    store->size = size;
+    store->hash = 0;
+    store->marked = false;
+    store->immortal = false;
+    store->mapped = sizeof(Store) + size >= LARGE_OBJECT;
+    stores.push_back(store);
+    bytes += size;
+    return store;
+  }
+
+  static void mark(Store *store) {
+    store->marked = true;
+  }
+
+  static void setImmortal(Store *store) {
+    store->marked = store->immortal = true;
+  }
+
+  void clearMarks() {
+    for (auto store : stores) {
+      store->marked = store->immortal;
+    }
+  }
+
+  size_t sweep(bool sticky) {
+    size_t freed = 0;
+    for (size_t i = 0; i < stores.size(); ) {
+      Store* store = stores[i];
+      if (store->marked) {
+        store->marked = sticky || store->immortal;
+        i++;
+        continue;
+      }
+      bytes -= store->size;
+      release(store);
+      stores[i] = stores.back();
+      stores.pop_back();
+      freed++;
+    }
+    return freed;
+  }
+
+  size_t size() const {
+    return stores.size();
+  }
+
+  size_t bytes;
+
+private:
+  static size_t extent(size_t size) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(Store) + size + page - 1) & ~(page - 1);
+  }
+
+  static void release(Store *store) {
+    if (store->mapped) {
+      munmap(store, extent(store->size));
+    } else {
+      ::free(store);
+    }
+  }
+
+  std::vector<Store*> stores;
+};
+
+/* The operand stack grows a segment at a time instead of living in one
+   fixed array, so a deep computation just costs another segment rather
+   than the process.  One spare segment is kept past the top so that a
+   stack bouncing across a segment boundary doesn't thrash the
+   allocator; anything beyond that is handed back as the stack shrinks.
+
+   Frames are just remembered depths: popping a frame drops everything
+   pushed since it was opened in one step.  Popping below where a frame
+   was opened closes the frame too, so popping a frame never brings
+   back slots that are already gone.
+
+   The stack also keeps a low-water mark: the shallowest depth it has
+   been popped down to since the collector last looked.  Every slot
+   beneath it still holds what it held then. */
+
+class OperandStack {
+public:
+  OperandStack(): dirty(false), depth(0), lowWater(0) {};
+
+  ~OperandStack() {
+    for (auto segment : segments) {
+      delete segment;
+    }
+  }
+
+  void push(Object *o) {
+    if (depth == segments.size() * STACK_SEGMENT) {
+      segments.push_back(new Segment);
+    }
+    segments[depth / STACK_SEGMENT]->slots[depth % STACK_SEGMENT] = o;
+    depth++;
+  }
+
+  Object* pop() {
+    my_assert(depth > 0, "Stack underflow!");
+    depth--;
+    lowWater = std::min(lowWater, depth);
+    while (!frames.empty() && frames.back() > depth) {
+      frames.pop_back();
+    }
+    Object* o = segments[depth / STACK_SEGMENT]->slots[depth % STACK_SEGMENT];
+    trim();
+    return o;
+  }
+
+  void pushFrame() {
+    frames.push_back(depth);
+  }
+
+  void popFrame() {
+    my_assert(!frames.empty(), "Frame underflow!");
+    depth = frames.back();
+    lowWater = std::min(lowWater, depth);
+    frames.pop_back();
+    trim();
+  }
+
+  Object* peek(size_t down = 0) const {
+    my_assert(down < depth, "Stack underflow!");
+    size_t i = depth - 1 - down;
+    return segments[i / STACK_SEGMENT]->slots[i % STACK_SEGMENT];
+  }
+
+  size_t size() const {
+    return depth;
+  }
+
+  size_t watermark() const {
+    return lowWater;
+  }
+
+  void resetWatermark() {
+    lowWater = depth;
+  }
+
+  /* Set while the stack has been switched to since the collector last
+     looked at it; a stack nobody has touched has nothing new on it. */
+  bool dirty;
+
+  /* Only the segments in use are visited, and only up to the top. */
+  template<typename F> void each(F f, size_t from = 0) const {
+    for (size_t i = from / STACK_SEGMENT; i * STACK_SEGMENT < depth; i++) {
+      size_t base = i * STACK_SEGMENT;
+      size_t n = std::min(depth - base, (size_t) STACK_SEGMENT);
+      const Ref* slots = segments[i]->slots;
+      for (size_t j = std::max(from, base) - base; j < n; j++) {
+        f(slots[j]);
+      }
+    }
+  }
+
+private:
+  struct Segment {
+    Ref slots[STACK_SEGMENT];
+  };
+
+  void trim() {
+    size_t wanted = depth / STACK_SEGMENT + 2;
+    while (segments.size() > wanted) {
+      delete segments.back();
+      segments.pop_back();
+    }
+  }
+
+  std::vector<Segment*> segments;
+  std::vector<size_t> frames;
+  size_t depth;
+  size_t lowWater;
+};
+
+/* Finalizers run here, on a thread of their own, so a slow one never
+   holds up the collection that found its object dead.  The thread
+   isn't started until there's something for it to run, and when the
+   queue is destroyed it finishes whatever is left first. */
+
+class FinalizerQueue {
+public:
+  FinalizerQueue(): running(false), stopping(false) {};
+
+  ~FinalizerQueue() {
+    if (!thread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    ready.notify_one();
+    thread.join();
+  }
+
+  void post(std::vector<std::function<void()>> &batch) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto &finalizer : batch) {
+        queue.push_back(std::move(finalizer));
+      }
+      if (!thread.joinable()) {
+        thread = std::thread([this] { run(); });
+      }
+    }
+    batch.clear();
+    ready.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return queue.empty() && !running; });
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+      ready.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      std::function<void()> finalizer = std::move(queue.front());
+      queue.pop_front();
+      running = true;
+      guard.unlock();
+      finalizer();
+      guard.lock();
+      running = false;
+      if (queue.empty()) {
+        idle.notify_all();
+      }
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable idle;
+  std::deque<std::function<void()>> queue;
+  bool running;
+  bool stopping;
+  std::thread thread;
+};
+
+/* Native code that holds onto an Object* across a push() has nothing
+   telling the collector about it, and the collection in that push()
+   can free the object out from under it.  A Handle is a slot in the
+   VM's handle table that the collector scans along with the stacks.
+
+   Slots come out of fixed-size chunks that never move, so a handle
+   can keep a plain pointer to its slot.  A HandleScope remembers the
+   table's top when it opens and puts it back when it closes, which
+   releases every handle made inside it in one step. */
+
+class HandleTable {
+public:
+  HandleTable(): top(0), scopes(0) {};
+
+  ~HandleTable() {
+    for (auto chunk : chunks) {
+      delete[] chunk;
+    }
+  }
+
+  Object** allocate(Object *o) {
+    my_assert(scopes > 0, "No HandleScope open!");
+    if (top == chunks.size() * HANDLE_CHUNK) {
+      chunks.push_back(new Object*[HANDLE_CHUNK]);
+    }
+    Object** slot = &chunks[top / HANDLE_CHUNK][top % HANDLE_CHUNK];
+    *slot = o;
+    top++;
+    return slot;
+  }
+
+  size_t enter() {
+    scopes++;
+    return top;
+  }
+
+  void exit(size_t mark) {
+    scopes--;
+    top = mark;
+  }
+
+  template<typename F> void each(F f) const {
+    for (size_t i = 0; i * HANDLE_CHUNK < top; i++) {
+      size_t n = std::min(top - i * HANDLE_CHUNK, (size_t) HANDLE_CHUNK);
+      Object* const* slots = chunks[i];
+      for (size_t j = 0; j < n; j++) {
+        f(slots[j]);
+      }
+    }
+  }
+
+private:
+  std::vector<Object**> chunks;
+  size_t top;
+  int scopes;
+};
+
+/* Every VM starts at MAX_BARRIER and doubles from there, so a process
+   full of VMs doing similar work will have them all collecting at the
+   same moment.  The coordinator breaks that lockstep two ways: each VM
+   gets a seed from which its thresholds are jittered, and a VM that
+   hits its threshold while too many others are mid-collection may put
+   its own collection off for a little while.
+
+   The coordinator can also hold a process-wide budget, counted in
+   objects like everything else here.  Each VM leases part of it and
+   comes back for more when its heap outgrows the lease.  A VM is always
+   entitled to its fair share; beyond that it borrows from whatever the
+   others aren't using.  When the budget runs short, the VMs that have
+   grown the most since their last collection are asked to collect,
+   and a borrower has to collect its own garbage before it can borrow
+   any more.  The budget is a target, not a hard cap: a VM whose live
+   data won't fit is granted the lease anyway. */
+
+/* VMs come in as many types as there are policy combinations, all
+   sharing the one coordinator, so it keeps its books on the part
+   they have in common. */
+
+class Tenant {
+public:
+  int numObjects;
+
+protected:
+  Tenant(): numObjects(0), lease(0), lastLive(0), growth(0), requested(false) {};
+
+  /* The lease belongs to the coordinator's books and is only touched
+     under its lock; growth is its estimate of our garbage. */
+  friend class Coordinator;
+  int lease;
+  int lastLive;
+  std::atomic<int> growth;
+  std::atomic<bool> requested;
+};
+
+class Coordinator {
+public:
+  Coordinator(int maxConcurrent = MAX_CONCURRENT, int budget = 0):
+    maxConcurrent(maxConcurrent), collecting(0), budget(budget), attached(0), leased(0) {};
+
+  static Coordinator& global() {
+    static Coordinator coordinator;
+    return coordinator;
+  }
+
+  /* The seed is just the attachment order, scrambled a little so that
+     neighbouring VMs don't get neighbouring thresholds. */
+  unsigned attach(Tenant *vm);
+  void detach(Tenant *vm);
+
+  /* Spread a threshold somewhere over [n, n + n/4]. */
+  int jitter(int threshold, unsigned &seed) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return threshold + (int)(seed % (unsigned)(threshold / 4 + 1));
+  }
+
+  /* A deferrable request is refused if the room is already full; a
+     non-deferrable one always goes ahead, but still counts. */
+  bool beginCollection(bool deferrable) {
+    if (collecting.fetch_add(1) >= maxConcurrent && deferrable) {
+      collecting--;
+      return false;
+    }
+    return true;
+  }
+
+  void endCollection() {
+    collecting--;
+  }
+
+  bool extend(Tenant &vm, bool force);
+  void settle(Tenant &vm);
+
+  int quota() {
+    return budget / std::max((int) vms.size(), 1);
+  }
+
+  int maxConcurrent;
+  std::atomic<int> collecting;
+  const int budget;
+
+private:
+  void requestCollections(Tenant &except, int shortage);
+
+  std::atomic<unsigned> attached;
+  std::mutex lock;
+  std::vector<Tenant*> vms;
+  int leased;
+};
+
+/* Where an allocation was asked for.  It defaults to the caller's
+   file and line: GCC and Clang evaluate these builtins where the
+   default argument is used, which is the trick C++20 builds
+   std::source_location on. */
+
+struct Site {
+  explicit Site(const char *file = __builtin_FILE(), int line = __builtin_LINE()):
+    file(file), line(line) {};
+
+  bool operator==(const Site &other) const {
+    return file == other.file && line == other.line;
+  }
+
+  const char* file;
+  int line;
+};
+
+/* The VM is a template over a handful of policies, so that a variant
+   tuned for one deployment is its own type, put together at compile
+   time, and nothing on the allocation or marking paths goes through a
+   virtual call.  Each policy is a small class; the VM either calls its
+   static members or keeps one as a member for the state it needs.
+
+   Allocator says how a heap hands out cells: PoolAllocator is first
+   fit over the free bits, BumpAllocator only ever moves up.
+
+   Tracer holds the objects marked but not yet traced, each with the
+   element to carry on from; a vector is traced MARK_SLICE elements at
+   a time, so a huge one can't flood the tracer all at once.
+   DepthFirstTracer is a stack, BreadthFirstTracer a queue, which
+   visits siblings together and so tends to walk memory in allocation
+   order.
+
+   Sweeper says when the dead are freed: EagerSweeper during the
+   collection, LazySweeper a chunk at a time as allocation reaches it.
+
+   Trigger sets the threshold for the next collection from the number
+   of live objects.  StaggeredTrigger jitters it and lets a collection
+   be deferred while the coordinator's room is full; DoublingTrigger is
+   plain doubling and never defers.
+
+   Barrier is the write barrier.  RememberingBarrier records old
+   objects written to in sticky mode; NoBarrier does nothing at all,
+   and sticky mode is refused without one. */
+
+struct PoolAllocator {
+  static void* allocate(Heap &heap) {
+    return heap.allocate();
+  }
+};
+
+struct BumpAllocator {
+  static void* allocate(Heap &heap) {
+    return heap.bump();
+  }
+};
+
+struct Gray {
+  Object* object;
+  size_t from;
+};
+
+class DepthFirstTracer {
+public:
+  void push(Gray gray) {
+    stack.push_back(gray);
+  }
+
+  bool pop(Gray &gray) {
+    if (stack.empty()) {
+      return false;
+    }
+    gray = stack.back();
+    stack.pop_back();
+    return true;
+  }
+
+private:
+  std::vector<Gray> stack;
+};
+
+class BreadthFirstTracer {
+public:
+  BreadthFirstTracer(): head(0) {};
+
+  void push(Gray gray) {
+    queue.push_back(gray);
+  }
+
+  bool pop(Gray &gray) {
+    if (head == queue.size()) {
+      queue.clear();
+      head = 0;
+      return false;
+    }
+    gray = queue[head++];
+    return true;
+  }
+
+private:
+  std::vector<Gray> queue;
+  size_t head;
+};
+
+struct EagerSweeper {
+  static size_t sweep(Heap &heap, bool sticky) {
+    return heap.sweep(sticky);
+  }
+};
+
+struct LazySweeper {
+  static size_t sweep(Heap &heap, bool sticky) {
+    return heap.deferSweep(sticky);
+  }
+};
+
+struct StaggeredTrigger {
+  static const bool defers = true;
+
+  static int threshold(int live, Coordinator &coordinator, unsigned &seed) {
+    return coordinator.jitter(std::max(live * 2, MAX_BARRIER), seed);
+  }
+};
+
+struct DoublingTrigger {
+  static const bool defers = false;
+
+  static int threshold(int live, Coordinator&, unsigned&) {
+    return std::max(live * 2, MAX_BARRIER);
+  }
+};
+
+/* Only an old object can end up pointing at a young one, and it only
+   needs remembering once per cycle. */
+class RememberingBarrier {
+public:
+  static const bool remembers = true;
+
+  void write(Object *o, bool sticky) {
+    if (sticky && Heap::isMarked(o) && Heap::remember(o)) {
+      remembered.push_back(o);
+    }
+  }
+
+  template<typename F> void drain(F f) {
+    for (Object *o : remembered) {
+      Heap::forget(o);
+      f(o);
+    }
+    remembered.clear();
+  }
+
+  template<typename F> void dropIf(F f) {
+    remembered.erase(std::remove_if(remembered.begin(), remembered.end(), f), remembered.end());
+  }
+
+  void clear() {
+    remembered.clear();
+  }
+
+private:
+  std::vector<Object*> remembered;
+};
+
+struct NoBarrier {
+  static const bool remembers = false;
+  void write(Object*, bool) {}
+  template<typename F> void drain(F) {}
+  template<typename F> void dropIf(F) {}
+  void clear() {}
+};
+
+template<class Allocator = PoolAllocator, class Tracer = DepthFirstTracer,
+         class Sweeper = EagerSweeper, class Trigger = StaggeredTrigger,
+         class Barrier = RememberingBarrier>
+class BasicVM : public Tenant {
+public:
+  /* Imagine my surprise when I learned that clang doesn't bother to
+     zero out memory allocated on the threadstack. */
+  BasicVM(Coordinator &coordinator = Coordinator::global()):
+    rootsScanned(0), regionOpen(false), escaped(false), regionShared(false),
+    sticky(false), minors(0), conservative(false), stackBase(0),
+    immediates(false), counting(false), pretenuring(false),
+    deferrals(0), coordinator(coordinator) {
+    seed = coordinator.attach(this);
+    maxObjects = Trigger::threshold(0, coordinator, seed);
+    maxBytes = LARGE_TRIGGER;
+    allocating = &heap;
+    allocatingLeaves = &leaves;
+    tasks.push_back(new OperandStack);
+    switchTask(0);
+  };
+
+  /* Finalizers for objects still alive get run on the way out. */
+  ~BasicVM() {
+    for (auto task : tasks) {
+      delete task;
+    }
+    coordinator.detach(this);
+    std::vector<std::function<void()>> batch;
+    for (auto &entry : finalizers) {
+      batch.push_back(std::move(entry.second));
+    }
+    if (!batch.empty()) {
+      finalizing.post(batch);
+    }
+  }
+  
+  Object* pop() {
+    return stack->pop();
+  }
+
+  void pushFrame() {
+    stack->pushFrame();
+  }
+
+  void popFrame() {
+    stack->popFrame();
+  }
+
+  size_t depth() const {
+    return stack->size();
+  }
+
+  /* Each task gets its own operand stack, and push and pop work on
+     whichever task is current.  Task 0 is the one the VM starts with
+     and can't be destroyed.  Every task's stack is a root; a minor
+     collection skips the stacks of tasks nobody has switched to since
+     the last one, and scans the rest only above their watermarks. */
+  int createTask() {
+    if (freeTasks.empty()) {
+      tasks.push_back(new OperandStack);
+      return tasks.size() - 1;
+    }
+    int id = freeTasks.back();
+    freeTasks.pop_back();
+    tasks[id] = new OperandStack;
+    return id;
+  }
+
+  void switchTask(int id) {
+    my_assert(id >= 0 && id < (int) tasks.size() && tasks[id], "No such task!");
+    current = id;
+    stack = tasks[id];
+    touch(stack);
+  }
+
+  void destroyTask(int id) {
+    my_assert(id > 0 && id < (int) tasks.size() && tasks[id], "No such task!");
+    my_assert(id != current, "Can't destroy the current task!");
+    if (tasks[id]->dirty) {
+      dirty.erase(std::find(dirty.begin(), dirty.end(), tasks[id]));
+    }
+    delete tasks[id];
+    tasks[id] = NULL;
+    freeTasks.push_back(id);
+  }
+
+  int currentTask() const {
+    return current;
+  }
+
+  /* This is basically the interface for a very primitive reverse
+     polish notation calculator of some kind.  A garbage-collected
+     Forth interpreter, perhaps. */
+
+  Object* push(int v, Site site = Site()) {
+    if (immediates && Object::fitsImmediate(v)) {
+      return _push(Object::immediate(v));
+    }
+    safepoint();
+    return _push(place(insert(new (Allocator::allocate(*allocatingLeaves)) Object(v)), site));
+  }
+
+  /* The operands stay on the stack until after the safepoint, so a
+     collection there can't free them out from under the new pair. */
+  Object* push(Site site = Site()) {
+    safepoint();
+    Object* tail = pop();
+    Object* head = pop();
+    increment(head);
+    increment(tail);
+    return _push(place(insert(new (Allocator::allocate(*allocating)) Object(head, tail)), site));
+  }
+
+  /* Like push(), except that if a shared pair with the same head and
+     tail already exists, that's what comes back, so equal structures
+     built from shared parts are the same object and can be compared
+     by address.  Shared pairs are immutable; setHead() and setTail()
+     refuse them.  The table only holds them weakly: after marking,
+     entries for pairs nothing else reached are dropped. */
+  Object* consShared(Site site = Site()) {
+    Object* tail = stack->peek(0);
+    Object* head = stack->peek(1);
+    auto found = shared.find(Cons{head, tail});
+    if (found != shared.end()) {
+      pop();
+      pop();
+      return _push(found->second);
+    }
+    Object* pair = push(site);
+    Heap::setImmutable(pair);
+    regionShared |= regionOpen;
+    shared.emplace(Cons{head, tail}, pair);
+    return pair;
+  }
+
+  /* The finalizer runs on the finalizer thread some time after the
+     object is found dead, by which point the object itself is gone:
+     anything the finalizer needs, such as the external resource the
+     object stood for, it has to hold itself.  It mustn't touch the VM.
+     Setting another replaces the first. */
+  void setFinalizer(Object *o, std::function<void()> finalizer) {
+    my_assert(o && !Object::isImmediate(o), "Only heap objects can have finalizers!");
+    Heap::setFinalizable(o);
+    finalizers[o] = std::move(finalizer);
+  }
+
+  void waitForFinalizers() {
+    finalizing.wait();
+  }
+
+  /* A promise from native code that nothing refers to o any more: no
+     stack slot, no handle, no other object, not even weakly.  Its cell
+     goes straight back on its heap's free list instead of waiting for
+     a sweep; with BumpAllocator, that's once nothing above it in its
+     chunk is still allocated, since freeing the topmost cell lowers
+     the chunk's top to the highest one left.  Anything o refers to is left for the collector
+     as usual.  Debug builds check the promise by marking from the
+     roots.  Shared pairs can't be released, since consShared() may
+     have handed one to anybody. */
+  void release(Object *o) {
+    my_assert(o && !Object::isImmediate(o), "Only heap objects can be released!");
+    my_assert(!Heap::isImmutable(o), "Can't release a shared pair!");
+    my_assert(!Heap::isImmortal(o), "Can't release a frozen object!");
+#ifdef DEBUG
+    my_assert(!reachable(o), "Released an object that's still reachable!");
+#endif
+    if (counting && (Heap::count(o) & IN_ZCT)) {
+      zct.erase(std::find(zct.begin(), zct.end(), o));
+    }
+    if (Heap::isRemembered(o)) {
+      remembered.dropIf([o](Object *r) { return r == o; });
+    }
+    std::vector<Object*> doomed;
+    free(o, doomed);
+    finalize(doomed);
+  }
+
+  /* Makes everything reachable from root immortal, weak targets
+     included: from here on every collection takes it as marked
+     without tracing it, and no sweep frees it, so a big structure
+     built once at startup stops costing anything per cycle.  Frozen
+     objects can still be written to; the barrier keeps those that
+     have been in outbound, and each collection traces their fields,
+     since they may now lead somewhere that isn't frozen.  Objects
+     don't move, so nothing is copied and no reference needs fixing,
+     but nor can the frozen objects be write-protected, sharing chunks
+     as they do with everything else.  Nothing can be frozen inside a
+     region. */
+  void freeze(Object *root) {
+    my_assert(!regionOpen, "Can't freeze inside a region!");
+    std::vector<Object*> work{root};
+    while (!work.empty()) {
+      Object* o = work.back();
+      work.pop_back();
+      if (!o || Object::isImmediate(o) || !Heap::setImmortal(o)) {
+        continue;
+      }
+      switch (o->kind()) {
+      case Object::INT:
+        break;
+      case Object::PAIR: {
+        const Object::Pair* pair = std::get_if<Object::PAIR>(&o->value);
+        work.push_back(pair->head);
+        work.push_back(pair->tail);
+        break;
+      }
+      case Object::BLOB:
+        LargeSpace::setImmortal(std::get_if<Object::BLOB>(&o->value)->store);
+        break;
+      case Object::STRING:
+        LargeSpace::setImmortal(std::get_if<Object::STRING>(&o->value)->store);
+        break;
+      case Object::WEAK:
+        work.push_back(std::get_if<Object::WEAK>(&o->value)->target);
+        break;
+      case Object::TABLE: {
+        const Object::Table* table = std::get_if<Object::TABLE>(&o->value);
+        LargeSpace::setImmortal(table->store);
+        for (size_t i = 0; i < table->capacity(); i++) {
+          const Object::Table::Entry &entry = table->entries()[i];
+          if ((Object*) entry.key) {
+            work.push_back(entry.key);
+            work.push_back(entry.value);
+          }
+        }
+        break;
+      }
+      case Object::VECTOR: {
+        const Object::Vector* vector = std::get_if<Object::VECTOR>(&o->value);
+        LargeSpace::setImmortal(vector->store);
+        for (size_t i = 0; i < vector->size(); i++) {
+          work.push_back(vector->elements()[i]);
+        }
+        break;
+      }
+      }
+    }
+  }
+
+  static bool isFrozen(const Object *o) {
+    return o && !Object::isImmediate(o) && Heap::isImmortal(o);
+  }
+
+  /* Pops the target and pushes a weak reference to it. */
+  Object* pushWeak() {
+    safepoint();
+    Object* target = pop();
+    pin(target);
+    return _push(insert(new (Allocator::allocate(*allocating)) Object(Object::Weak{target})));
+  }
+
+  Object* pushTable() {
+    safepoint();
+    Object::Table table{large.allocate(Object::Table::bytes(8))};
+    return _push(insert(new (Allocator::allocate(*allocating)) Object(table)));
+  }
+
+  void tablePut(Object *table, Object *key, Object *value) {
+    Object::Table* t = std::get_if<Object::Table>(&table->value);
+    my_assert(t != NULL, "Not a table!");
+    my_assert(key != NULL, "Tables can't have a null key!");
+    barrier(table);
+    escape(table, key);
+    escape(table, value);
+    pin(key);
+    pin(value);
+    if ((t->count() + 1) * 2 > t->capacity()) {
+      rehash(t, t->capacity() * 2, false);
+    }
+    Object::Table::Entry* entry = t->find(key);
+    if (!(Object*) entry->key) {
+      t->count()++;
+      entry->key = key;
+    }
+    entry->value = value;
+  }
+
+  /* Null if the key isn't there. */
+  Object* tableGet(Object *table, Object *key) const {
+    const Object::Table* t = std::get_if<Object::Table>(&table->value);
+    my_assert(t != NULL, "Not a table!");
+    Object::Table::Entry* entry = t->find(key);
+    return (Object*) entry->key ? (Object*) entry->value : NULL;
+  }
+
+  /* Pops the top n objects into a new vector, the topmost last.  Like
+     push(), it leaves them on the stack until after the safepoint. */
+  Object* pushVector(size_t n) {
+    my_assert(n <= stack->size(), "Stack underflow!");
+    safepoint();
+    Object::Vector vector{large.allocate(n * sizeof(Ref))};
+    for (size_t i = n; i > 0; i--) {
+      vector.elements()[i - 1] = pop();
+      increment(vector.elements()[i - 1]);
+    }
+    return _push(insert(new (Allocator::allocate(*allocating)) Object(vector)));
+  }
+
+  Object* pushString(const std::string &s) {
+    safepoint();
+    Store* store = large.allocate(s.size());
+    memcpy(store->bytes(), s.data(), s.size());
+    return _push(insert(new (Allocator::allocate(*allocating)) Object(Object::String{store})));
+  }
+
+  /* A zeroed blob of the given size.  The bytes stay put for as long
+     as the blob lives, but keep the Object*, not a pointer into them:
+     only the object keeps its store alive. */
+  Object* pushBlob(size_t size) {
+    safepoint();
+    Store* store = large.allocate(size);
+    return _push(insert(new (Allocator::allocate(*allocating)) Object(Object::Blob{store})));
+  }
+
+  /* With sticky marks, survivors keep their mark bits from one
+     collection to the next, so a marked object is an old one and
+     everything it reaches is already marked.  A minor collection then
+     only has to trace from the stack slots above the low-water mark
+     and from old objects that have since been pointed at something
+     new, which is what the write barrier below remembers.  Every
+     STICKY_FULL_EVERY collections we clear the slate and do a full one.
+
+     Pairs must be mutated through setHead() and setTail() in this
+     mode; a write that goes around the barrier can lose objects. */
+  void setSticky(bool on) {
+    my_assert(!on || Barrier::remembers, "Sticky marks need a write barrier!");
+    my_assert(!on || !counting, "Sticky marks don't mix with reference counting!");
+    if (sticky && !on) {
+      clearMarks();
+    }
+    sticky = on;
+    minors = STICKY_FULL_EVERY;
+  }
+
+  void setHead(Object *pair, Object *head) {
+    my_assert(pair->kind() == Object::PAIR, "Not a pair!");
+    my_assert(!Heap::isImmutable(pair), "Can't change a shared pair!");
+    barrier(pair);
+    Object::Pair* p = std::get_if<Object::Pair>(&pair->value);
+    escape(pair, head);
+    increment(head);
+    decrement(p->head);
+    p->head = head;
+  }
+
+  void setTail(Object *pair, Object *tail) {
+    my_assert(pair->kind() == Object::PAIR, "Not a pair!");
+    my_assert(!Heap::isImmutable(pair), "Can't change a shared pair!");
+    barrier(pair);
+    Object::Pair* p = std::get_if<Object::Pair>(&pair->value);
+    escape(pair, tail);
+    increment(tail);
+    decrement(p->tail);
+    p->tail = tail;
+  }
+
+  void setElement(Object *vector, size_t i, Object *element) {
+    Object::Vector* v = std::get_if<Object::Vector>(&vector->value);
+    my_assert(v != NULL, "Not a vector!");
+    my_assert(i < v->size(), "Index out of range!");
+    barrier(vector);
+    escape(vector, element);
+    increment(element);
+    decrement(v->elements()[i]);
+    v->elements()[i] = element;
+  }
+
+  /* In conservative mode a collection also treats every word on the
+     native thread stack, and in the registers, as a possible pointer,
+     so embedders can keep raw Object* locals around without handles.
+     It only scans the thread that runs the collection.  The stack's
+     base comes from pthreads on Linux; elsewhere, or for a thread
+     whose stack pthreads doesn't know about, pass it in. */
+  void setConservative(bool on, const void *base = NULL) {
+    my_assert(!on || !counting, "Conservative scanning doesn't mix with reference counting!");
+    conservative = on;
+    escaped = escaped || (on && regionOpen);
+    if (!on) {
+      return;
+    }
+    stackBase = reinterpret_cast<uintptr_t>(base);
+#ifdef __linux__
+    if (!stackBase) {
+      pthread_attr_t attr;
+      void* addr;
+      size_t size;
+      pthread_getattr_np(pthread_self(), &attr);
+      pthread_attr_getstack(&attr, &addr, &size);
+      pthread_attr_destroy(&attr);
+      stackBase = reinterpret_cast<uintptr_t>(addr) + size;
+    }
+#endif
+    my_assert(stackBase != 0, "Conservative scanning needs a stack base.");
+  }
+
+  /* In reference counting mode, every reference from one object to
+     another is counted, but references from the stacks and handles
+     aren't, so pushing and popping cost nothing.  That makes a zero
+     count mean only "maybe garbage": such objects go in the zero count
+     table, and every ZCT_BATCH of them, at a safepoint, the collector
+     marks whatever the roots point at directly, no deeper, and frees
+     the rest, along with anything whose count that takes to zero.
+     Garbage is reclaimed within a batch of becoming garbage instead of
+     waiting for the heap to double.
+
+     Counting can't see a cycle, so the ordinary collector stays on as
+     a backup, and recomputes the counts while it traces.  Objects held
+     by weak references or tables are pinned, left to the tracer, since
+     those references aren't counted.  Turning counting on collects, to
+     get the counts right for what's already allocated.  It needs the
+     eager sweeper, and doesn't mix with sticky marks or conservative
+     scanning. */
+  void setRefCounting(bool on) {
+    my_assert(!on || (!sticky && !conservative), "Reference counting needs plain marking!");
+    my_assert(!on || !regionOpen, "Can't start counting inside a region!");
+    my_assert(!on || std::is_same<Sweeper, EagerSweeper>::value,
+              "Reference counting needs the eager sweeper!");
+    counting = on;
+    zct.clear();
+    if (on) {
+      heap.setCounted();
+      leaves.setCounted();
+      collect();
+    }
+  }
+
+  /* Process the zero count table now rather than at the next full
+     batch. */
+  void flushCounts() {
+    std::vector<Object*> roots;
+    auto hold = [&roots](Object *o) {
+      if (o && !Object::isImmediate(o) && Heap::mark(o)) {
+        roots.push_back(o);
+      }
+    };
+    for (OperandStack *task : tasks) {
+      if (task) {
+        task->each(hold);
+      }
+    }
+    handles.each(hold);
+
+    std::vector<Object*> kept;
+    std::vector<Object*> doomed;
+    while (!zct.empty()) {
+      Object* o = zct.back();
+      zct.pop_back();
+      uint32_t &count = Heap::count(o);
+      if (count & ~IN_ZCT) {
+        count &= ~IN_ZCT;
+      } else if (Heap::isImmortal(o)) {
+        count = 0;
+      } else if (Heap::isMarked(o)) {
+        kept.push_back(o);
+      } else {
+        free(o, doomed);
+      }
+    }
+    zct.swap(kept);
+    for (Object *o : roots) {
+      Heap::unmark(o);
+    }
+    finalize(doomed);
+  }
+
+  /* Everything allocated between enterRegion() and exitRegion() goes
+     into heaps of the region's own.  Collections in the meantime treat
+     them like any other.  At the end, if nothing outside the region
+     refers to anything in it, the region's chunks are handed back
+     whole, with no marking and no sweeping.  Something outside could
+     be a stack slot or a handle, checked at the end, or an object
+     written through setHead(), setTail(), setElement() or tablePut()
+     while the region was open, checked as it happens.  If something
+     does escape, the main heaps adopt the region's chunks as they
+     stand, and the next collection sweeps out whatever in them is
+     dead; nothing moves.  A conservative VM can't be sure about the
+     native stack, so its regions always end that way, as does any
+     region open when conservative scanning is turned on.
+
+     Regions don't nest, and don't mix with reference counting.  The
+     return value says whether the region was freed. */
+  void enterRegion() {
+    my_assert(!regionOpen, "Regions don't nest!");
+    my_assert(!counting, "Regions don't mix with reference counting!");
+    regionOpen = true;
+    escaped = conservative;
+    regionShared = false;
+    allocating = &regionHeap;
+    allocatingLeaves = &regionLeaves;
+  }
+
+  bool exitRegion() {
+    my_assert(regionOpen, "No region open!");
+    regionOpen = false;
+    allocating = &heap;
+    allocatingLeaves = &leaves;
+
+    auto check = [this](Object *o) {
+      escaped = escaped || (o && !Object::isImmediate(o) && Heap::inRegion(o));
+    };
+    for (OperandStack *task : tasks) {
+      if (task && !escaped) {
+        task->each(check);
+      }
+    }
+    handles.each(check);
+
+    if (escaped) {
+      heap.adopt(regionHeap);
+      leaves.adopt(regionLeaves);
+      return false;
+    }
+
+    auto inRegion = [](Object *o) { return Heap::inRegion(o); };
+    remembered.dropIf(inRegion);
+    if (regionShared) {
+      for (auto i = shared.begin(); i != shared.end(); ) {
+        i = Heap::inRegion(i->second) ? shared.erase(i) : std::next(i);
+      }
+    }
+    numObjects -= regionHeap.releaseAll() + regionLeaves.releaseAll();
+    finalize(regionHeap.doomed);
+    finalize(regionLeaves.doomed);
+    return true;
+  }
+
+  /* With pretenuring on, every object allocated by push() remembers
+     its call site, and each collection tallies, per site, how many of
+     the objects it sees for the first time survived.  Once a site has
+     PRETENURE_SAMPLES of them and at least PRETENURE_SURVIVAL percent
+     lived, it's pretenured: with sticky marks, its objects are born
+     marked, old from the start, and remembered so that the next minor
+     collection still traces what they point at.  Nothing here is
+     copied, so what that saves is the minor collections' work of
+     discovering, object by object, that a structure built once at
+     startup is here to stay.  Without sticky marks there's no old
+     space, and sites are only tallied.  Regions don't keep sites. */
+  void setPretenuring(bool on) {
+    pretenuring = on;
+    if (on) {
+      heap.setSited();
+      leaves.setSited();
+    }
+  }
+
+  bool isPretenured(Site site) const {
+    auto i = siteIds.find(site);
+    return i != siteIds.end() && sites[i->second].pretenured;
+  }
+
+  /* With immediates on, push(int) stores small integers in the stack
+     slot itself rather than allocating; they're just as good as pair
+     fields.  Off by default, since then push(int) doesn't hand back
+     anything you could read an Object's value from. */
+  void setImmediateInts(bool on) {
+    immediates = on;
+  }
+
+  /* This used to be a lambda-style visitor, recursing for descent.
+     Now marking switches straight on the variant's index, with no
+     visitor and no bad_variant_access to guard against in between,
+     and keeps the objects it still has to trace on an explicit stack,
+     so a long list can't run the C stack out.  The benchmark below is
+     how the representation was chosen. */
+  void mark(Object *o) {
+    shade(o);
+    drain();
+  }
+
+  /* For objects that are already marked but need tracing anyway. */
+  void markChildren(Object *o) {
+    trace(o);
+    drain();
+  }
+
+  /* So named because each scope resembles a collection of objects
+     leading horizontally from the vertical stack, creating a spine. */
+  void markSpine(OperandStack *task, size_t from = 0) {
+    rootsScanned += task->size() - std::min(from, task->size());
+    task->each([this](Object *o) { mark(o); }, from);
+    task->resetWatermark();
+  }
+
+  void collect() {
+    coordinator.beginCollection(false);
+    reclaim(false);
+    coordinator.endCollection();
+  }
+
+  /* Without sticky marks every collection is a full one. */
+  void minorCollect() {
+    coordinator.beginCollection(false);
+    reclaim(true);
+    coordinator.endCollection();
+  }
+
+  int threshold() const {
+    return maxObjects;
+  }
+
+  /* Honour any collection the coordinator has asked for, and collect
+     if we're due.  Every allocation passes through here; embedders
+     that go a long time without allocating can call it themselves. */
+  void safepoint() {
+    if (counting && zct.size() >= ZCT_BATCH) {
+      flushCounts();
+    }
+
+    if (requested.load(std::memory_order_relaxed)) {
+      requested = false;
+      collect();
+    }
+
+    if (numObjects >= lease && !coordinator.extend(*this, false)) {
+      collect();
+      if (numObjects >= lease) {
+        coordinator.extend(*this, true);
+      }
+    }
+
+    if (numObjects < maxObjects && large.bytes < maxBytes) {
+      return;
+    }
+
+    bool deferrable = Trigger::defers && deferrals < MAX_DEFERRALS;
+    if (!coordinator.beginCollection(deferrable)) {
+      deferrals++;
+      maxObjects += maxObjects / 8 + 1;
+      maxBytes += maxBytes / 8;
+      return;
+    }
+    reclaim(true);
+    coordinator.endCollection();
+  }
+
+  bool collectionRequested() const {
+    return requested;
+  }
+
+  /* The saddest fact used to live here: I went with using NULL as our
+     end-of-list discriminator, and sweeping meant walking every object
+     down that list.  The list is gone.  The chunks' bitmaps say what's
+     allocated and what's marked, so a sweep is a pass over words.
+
+     I look at this and ask, WWHSD?  What Would Herb Sutter Do? */
+  
+  void sweep() {
+    numObjects -= Sweeper::sweep(heap, sticky) + Sweeper::sweep(leaves, sticky)
+      + Sweeper::sweep(regionHeap, sticky) + Sweeper::sweep(regionLeaves, sticky);
+    large.sweep(sticky);
+    for (Heap *space : { &heap, &leaves, &regionHeap, &regionLeaves }) {
+      if (!space->doomed.empty()) {
+        finalize(space->doomed);
+      }
+    }
+  }
+
+  size_t heapChunks() const {
+    return heap.size() + leaves.size() + regionHeap.size() + regionLeaves.size();
+  }
+
+  size_t largeStores() const {
+    return large.size();
+  }
+
+  size_t largeBytes() const {
+    return large.bytes;
+  }
+      
+  size_t rootsScanned;
+  
+private:
+
+  void reclaim(bool partial) {
+    int num = numObjects;
+    bool minor = partial && sticky && minors < STICKY_FULL_EVERY;
+    heap.finishSweep();
+    leaves.finishSweep();
+    regionHeap.finishSweep();
+    regionLeaves.finishSweep();
+    if (sticky && !minor) {
+      clearMarks();
+    }
+    resetMarking();
+    if (counting) {
+      heap.clearCounts();
+      leaves.clearCounts();
+      zct.clear();
+    }
+    markRoots(minor);
+    finishMarking();
+    if (counting) {
+      refillZct();
+    }
+    if (pretenuring) {
+      judgeSites();
+    }
+    minors = minor ? minors + 1 : 0;
+    sweep();
+    deferrals = 0;
+    maxObjects = Trigger::threshold(numObjects, coordinator, seed);
+    maxBytes = std::max(large.bytes * 2, (size_t) LARGE_TRIGGER);
+    lastLive = numObjects;
+    growth = 0;
+    coordinator.settle(*this);
+#ifdef DEBUG
+    std::cout << "Collected " << (num - numObjects) << " objects, "
+              << numObjects << " remain." << std::endl;
+#endif
+  }
+
+  void markRoots(bool minor) {
+    for (OperandStack *task : minor ? dirty : tasks) {
+      if (task) {
+        markSpine(task, minor ? task->watermark() : 0);
+      }
+    }
+    for (OperandStack *task : dirty) {
+      task->dirty = false;
+    }
+    dirty.clear();
+    touch(stack);
+
+    if (minor) {
+      remembered.drain([this](Object *o) { markChildren(o); });
+    }
+    for (Object *o : outbound) {
+      markChildren(o);
+    }
+
+    handles.each([this](Object *o) { mark(o); });
+    if (conservative) {
+      markNativeStack();
+    }
+  }
+
+  /* The side tables a mark phase builds up, none of which outlive it. */
+  void resetMarking() {
+    strings.clear();
+    weaks.clear();
+    tables.clear();
+    pending.clear();
+  }
+
+  void finishMarking() {
+    clearWeaks();
+    clearTables();
+    pruneShared();
+    resetMarking();
+  }
+
+  /* Every weak reference traced this cycle is on the list, so once
+     marking is done, clearing the dead targets is one pass over it.
+     An old weak reference skipped by a minor collection can only point
+     at something at least as old, which the minor doesn't free. */
+  void clearWeaks() {
+    for (Object *o : weaks) {
+      Object::Weak* weak = std::get_if<Object::WEAK>(&o->value);
+      Object* target = weak->target;
+      if (target && !Object::isImmediate(target) && !Heap::isMarked(target)) {
+        weak->target = NULL;
+      }
+    }
+    weaks.clear();
+  }
+
+  /* Whatever is still pending once marking is done has a dead key.
+     Only tables traced this cycle can have one: an old table skipped
+     by a minor collection has only old keys. */
+  void clearTables() {
+    for (Object *o : tables) {
+      Object::Table* table = std::get_if<Object::TABLE>(&o->value);
+      for (size_t i = 0; i < table->capacity(); i++) {
+        Object* key = table->entries()[i].key;
+        if (key && !Object::isImmediate(key) && !Heap::isMarked(key)) {
+          rehash(table, table->capacity(), true);
+          break;
+        }
+      }
+    }
+  }
+
+  /* Into a new store, which the collector, pruning, has to mark
+     itself, since it's past the point of tracing the table.  The old
+     store is left for the sweep. */
+  void rehash(Object::Table *table, size_t capacity, bool prune) {
+    Object::Table rehashed{large.allocate(Object::Table::bytes(capacity))};
+    for (size_t i = 0; i < table->capacity(); i++) {
+      Object::Table::Entry &entry = table->entries()[i];
+      Object* key = entry.key;
+      if (key && (!prune || Object::isImmediate(key) || Heap::isMarked(key))) {
+        *rehashed.find(key) = entry;
+        rehashed.count()++;
+      }
+    }
+    if (prune) {
+      LargeSpace::mark(rehashed.store);
+    }
+    if (table->store->immortal) {
+      table->store->immortal = false;
+      LargeSpace::setImmortal(rehashed.store);
+    }
+    table->store = rehashed.store;
+  }
+
+  Object* place(Object *o, Site site) {
+    if (!pretenuring) {
+      return o;
+    }
+    auto found = siteIds.emplace(site, (uint32_t) sites.size());
+    if (found.second) {
+      sites.push_back(SiteStats{0, 0, false});
+    }
+    uint32_t id = found.first->second;
+    if (!sites[id].pretenured) {
+      Heap::setSite(o, id);
+    } else if (sticky && !Heap::inRegion(o)) {
+      Heap::mark(o);
+      barrier(o);
+    }
+    return o;
+  }
+
+  void judgeSites() {
+    auto tally = [this](uint32_t id, bool survived) {
+      sites[id].allocated++;
+      sites[id].survived += survived;
+    };
+    heap.judge(tally);
+    leaves.judge(tally);
+    for (SiteStats &site : sites) {
+      if (!site.pretenured && site.allocated >= PRETENURE_SAMPLES &&
+          site.survived * 100 >= site.allocated * PRETENURE_SURVIVAL) {
+        site.pretenured = true;
+      }
+    }
+  }
+
+  void escape(Object *holder, Object *o) {
+    if (regionOpen && o && !Object::isImmediate(o) && Heap::inRegion(o) && !Heap::inRegion(holder)) {
+      escaped = true;
+    }
+  }
+
+  void increment(Object *o) {
+    if (counting && o && !Object::isImmediate(o)) {
+      uint32_t &count = Heap::count(o);
+      if ((count & ~IN_ZCT) != PINNED) {
+        count++;
+      }
+    }
+  }
+
+  void decrement(Object *o) {
+    if (counting && o && !Object::isImmediate(o)) {
+      uint32_t &count = Heap::count(o);
+      uint32_t n = count & ~IN_ZCT;
+      if (n != PINNED && n != 0 && --count == 0) {
+        count = IN_ZCT;
+        zct.push_back(o);
+      }
+    }
+  }
+
+  void pin(Object *o) {
+    if (counting && o && !Object::isImmediate(o)) {
+      Heap::count(o) |= PINNED;
+    }
+  }
+
+  /* After a backup collection has recounted everything, the survivors
+     that only the roots hold. */
+  void refillZct() {
+    auto refill = [this](Object *o) {
+      if (Heap::count(o) == 0 && !Heap::isImmortal(o)) {
+        Heap::count(o) = IN_ZCT;
+        zct.push_back(o);
+      }
+    };
+    heap.eachMarked(refill);
+    leaves.eachMarked(refill);
+  }
+
+#ifdef DEBUG
+  /* Marks everything from scratch, counting or not, and leaves the
+     marks clear again afterwards.  With sticky marks, that means the
+     next collection has to be a full one. */
+  bool reachable(Object *o) {
+    bool wasCounting = counting;
+    counting = false;
+    clearMarks();
+    resetMarking();
+    markRoots(false);
+    bool found = Heap::isMarked(o);
+    for (Object *w : weaks) {
+      found = found || (Object*) std::get_if<Object::WEAK>(&w->value)->target == o;
+    }
+    for (Object *t : tables) {
+      const Object::Table* table = std::get_if<Object::TABLE>(&t->value);
+      for (size_t i = 0; i < table->capacity(); i++) {
+        const Object::Table::Entry &entry = table->entries()[i];
+        found = found || (Object*) entry.key == o || ((Object*) entry.key && (Object*) entry.value == o);
+      }
+    }
+    resetMarking();
+    clearMarks();
+    minors = STICKY_FULL_EVERY;
+    counting = wasCounting;
+    return found;
+  }
+#endif
+
+  /* Frees a cell, whether its count has gone to zero or it was
+     released, dropping the counts it held.  Its store, if it has one,
+     waits for the next sweep. */
+  void free(Object *o, std::vector<Object*> &doomed) {
+    switch (o->kind()) {
+    case Object::PAIR: {
+      const Object::Pair* pair = std::get_if<Object::PAIR>(&o->value);
+      if (Heap::isImmutable(o)) {
+        shared.erase(Cons{pair->head, pair->tail});
+      }
+      decrement(pair->head);
+      decrement(pair->tail);
+      break;
+    }
+    case Object::VECTOR: {
+      const Object::Vector* vector = std::get_if<Object::VECTOR>(&o->value);
+      for (size_t i = 0; i < vector->size(); i++) {
+        decrement(vector->elements()[i]);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    if (Heap::isFinalizable(o)) {
+      doomed.push_back(o);
+    }
+    o->~Object();
+    spaceOf(o).free(o);
+    numObjects--;
+  }
+
+  Heap& spaceOf(const Object *o) {
+    if (Heap::inRegion(o)) {
+      return Heap::isLeaf(o) ? regionLeaves : regionHeap;
+    }
+    return Heap::isLeaf(o) ? leaves : heap;
+  }
+
+  void finalize(std::vector<Object*> &doomed) {
+    std::vector<std::function<void()>> batch;
+    for (Object *o : doomed) {
+      auto i = finalizers.find(o);
+      batch.push_back(std::move(i->second));
+      finalizers.erase(i);
+    }
+    doomed.clear();
+    if (!batch.empty()) {
+      finalizing.post(batch);
+    }
+  }
+
+  void pruneShared() {
+    for (auto i = shared.begin(); i != shared.end(); ) {
+      i = Heap::isMarked(i->second) ? std::next(i) : shared.erase(i);
+    }
+  }
+
+  void shade(Object *o) {
+    if (o && !Object::isImmediate(o) && Heap::mark(o)) {
+      if (!pending.empty()) {
+        unblock(o);
+      }
+      if (!Heap::isLeaf(o)) {
+        marking.push(Gray{o, 0});
+      }
+    }
+  }
+
+  /* The values of table entries waiting on a key that has just been
+     marked.  They're shaded from drain() rather than here, so a chain
+     of entries, each value the next one's key, can't recurse. */
+  void unblock(Object *key) {
+    auto range = pending.equal_range(key);
+    for (auto i = range.first; i != range.second; ++i) {
+      unblocked.push_back(i->second);
+    }
+    pending.erase(range.first, range.second);
+  }
+
+  void trace(Object *o, size_t from = 0) {
+    switch (o->kind()) {
+    case Object::INT:
+      break;
+    case Object::PAIR: {
+      const Object::Pair* pair = std::get_if<Object::PAIR>(&o->value);
+      shade(pair->head);
+      shade(pair->tail);
+      if (counting) {
+        increment(pair->head);
+        increment(pair->tail);
+      }
+      break;
+    }
+    case Object::BLOB:
+      LargeSpace::mark(std::get_if<Object::BLOB>(&o->value)->store);
+      break;
+    case Object::STRING: {
+      Object::String* string = std::get_if<Object::STRING>(&o->value);
+      hash(string->store);
+      string->store = *strings.insert(string->store).first;
+      LargeSpace::mark(string->store);
+      break;
+    }
+    case Object::WEAK:
+      weaks.push_back(o);
+      pin(std::get_if<Object::WEAK>(&o->value)->target);
+      break;
+    case Object::TABLE: {
+      const Object::Table* table = std::get_if<Object::TABLE>(&o->value);
+      LargeSpace::mark(table->store);
+      tables.push_back(o);
+      for (size_t i = 0; i < table->capacity(); i++) {
+        const Object::Table::Entry &entry = table->entries()[i];
+        Object* key = entry.key;
+        if (!key) {
+          continue;
+        }
+        pin(key);
+        pin(entry.value);
+        if (Object::isImmediate(key) || Heap::isMarked(key)) {
+          shade(entry.value);
+        } else {
+          pending.emplace(key, entry.value);
+        }
+      }
+      break;
+    }
+    case Object::VECTOR: {
+      const Object::Vector* vector = std::get_if<Object::VECTOR>(&o->value);
+      size_t end = std::min(vector->size(), from + MARK_SLICE);
+      if (from == 0) {
+        LargeSpace::mark(vector->store);
+      }
+      if (end < vector->size()) {
+        marking.push(Gray{o, end});
+      }
+      for (size_t i = from; i < end; i++) {
+        shade(vector->elements()[i]);
+        if (counting) {
+          increment(vector->elements()[i]);
+        }
+      }
+      break;
+    }
+    }
+  }
+
+  void drain() {
+    Gray gray;
+    for (;;) {
+      if (marking.pop(gray)) {
+        trace(gray.object, gray.from);
+      } else if (!unblocked.empty()) {
+        Object* o = unblocked.back();
+        unblocked.pop_back();
+        shade(o);
+      } else {
+        break;
+      }
+    }
+  }
+
+  /* setjmp() spills the callee-saved registers into a buffer in this
+     frame; scanning from the frame of a call made after it covers both
+     the registers and everything above. */
+  void __attribute__((noinline)) markNativeStack() {
+    jmp_buf registers;
+    setjmp(registers);
+    markNativeRange();
+  }
+
+  void __attribute__((noinline)) markNativeRange() {
+    uintptr_t top = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    top = (top + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    markRange(reinterpret_cast<const uintptr_t*>(top),
+              reinterpret_cast<const uintptr_t*>(stackBase));
+  }
+
+  /* Nearly every word on a stack misses the heap entirely, so test
+     four at a time against the heap's bounds before looking any
+     closer.  The vector extension compiles down to SSE, AVX or NEON
+     compares where the target has them. */
+  void __attribute__((no_sanitize_address)) markRange(const uintptr_t *from, const uintptr_t *to) {
+    typedef uintptr_t Words __attribute__((vector_size(4 * sizeof(uintptr_t))));
+    const uintptr_t low = std::min({ heap.lo, leaves.lo, regionHeap.lo, regionLeaves.lo });
+    const uintptr_t high = std::max({ heap.hi, leaves.hi, regionHeap.hi, regionLeaves.hi });
+    const Words lo = { low, low, low, low };
+    const Words hi = { high, high, high, high };
+    const uintptr_t *p = from;
+    for (; p + 4 <= to; p += 4) {
+      Words words;
+      memcpy(&words, p, sizeof(words));
+      auto hits = (words >= lo) & (words < hi);
+      if (hits[0] | hits[1] | hits[2] | hits[3]) {
+        for (int i = 0; i < 4; i++) {
+          markCandidate(p[i]);
+        }
+      }
+    }
+    for (; p < to; p++) {
+      markCandidate(*p);
+    }
+  }
+
+  void markCandidate(uintptr_t word) {
+    if (Object *o = heap.find(word)) {
+      mark(o);
+    } else if (Object *o = leaves.find(word)) {
+      mark(o);
+    } else if (Object *o = regionHeap.find(word)) {
+      mark(o);
+    } else if (Object *o = regionLeaves.find(word)) {
+      mark(o);
+    }
+  }
+
+  void barrier(Object *o) {
+    if (Heap::isImmortal(o)) {
+      outbound.insert(o);
+      return;
+    }
+    remembered.write(o, sticky);
+  }
+
+  void touch(OperandStack *task) {
+    if (!task->dirty) {
+      task->dirty = true;
+      dirty.push_back(task);
+    }
+  }
+
+  void clearMarks() {
+    heap.clearMarks();
+    leaves.clearMarks();
+    regionHeap.clearMarks();
+    regionLeaves.clearMarks();
+    large.clearMarks();
+    remembered.clear();
+  }
+
+  /* There used to be a "Stark overflow" here, typo and all.  The stack
+     grows now, so Tony has retired. */
+  Object* _push(Object *o) {
+    stack->push(o);
+    return o;
+  }
+  
+  Object* insert(Object *o) {
+    if (counting) {
+      Heap::count(o) = IN_ZCT;
+      zct.push_back(o);
+    }
+    numObjects++;
+    growth.store(numObjects - lastLive, std::memory_order_relaxed);
+    return o;
+  }
+    
+  Heap heap;
+  Heap leaves{true};
+  Heap regionHeap{false, true};
+  Heap regionLeaves{true, true};
+  Heap* allocating;
+  Heap* allocatingLeaves;
+  bool regionOpen;
+  bool escaped;
+  bool regionShared;
+  LargeSpace large;
+  OperandStack* stack;
+  std::vector<OperandStack*> tasks;
+  std::vector<OperandStack*> dirty;
+  std::vector<int> freeTasks;
+  int current;
+
+  friend class Handle;
+  friend class HandleScope;
+  HandleTable handles;
+  Tracer marking;
+  Barrier remembered;
+  std::vector<Object*> weaks;
+
+  /* Ephemeron marking.  A traced table shades the values of entries
+     whose keys are already marked and files the rest here by key;
+     marking a key releases its values.  Each entry is looked at once
+     per table trace, however long the chain of tables, and whatever
+     is still here at the end is dead. */
+  std::vector<Object*> tables;
+  std::unordered_multimap<Object*, Object*> pending;
+  std::vector<Object*> unblocked;
+
+  /* Every string store marked so far this collection, by contents.  A
+     string traced later with the same contents is pointed at the one
+     already here, and its own store, left unmarked, is swept.  A store
+     is hashed the first time it's traced, not when it's made, so the
+     mutator never pays for it and strings that die young never get
+     hashed at all.  Zero means not hashed yet. */
+  static void hash(Store *store) {
+    if (!store->hash) {
+      store->hash = std::hash<std::string_view>()(std::string_view(store->bytes(), store->size)) | 1;
+    }
+  }
+
+  struct Contents {
+    size_t operator()(const Store *s) const {
+      return s->hash;
+    }
+
+    bool operator()(Store *a, Store *b) const {
+      return a->size == b->size && !memcmp(a->bytes(), b->bytes(), a->size);
+    }
+  };
+  std::unordered_set<Store*, Contents, Contents> strings;
+
+  /* Shared pairs by the identity of their head and tail. */
+  struct Cons {
+    Object* head;
+    Object* tail;
+
+    bool operator==(const Cons &other) const {
+      return head == other.head && tail == other.tail;
+    }
+  };
+  struct ConsHash {
+    size_t operator()(const Cons &c) const {
+      return std::hash<Object*>()(c.head) * 31 + std::hash<Object*>()(c.tail);
+    }
+  };
+  std::unordered_map<Cons, Object*, ConsHash> shared;
+
+  std::unordered_map<Object*, std::function<void()>> finalizers;
+  FinalizerQueue finalizing;
+  bool sticky;
+  int minors;
+  bool conservative;
+  uintptr_t stackBase;
+  bool immediates;
+  bool counting;
+  std::vector<Object*> zct;
+
+  struct SiteStats {
+    size_t allocated;
+    size_t survived;
+    bool pretenured;
+  };
+  struct SiteHash {
+    size_t operator()(const Site &site) const {
+      return std::hash<const char*>()(site.file) * 31 + site.line;
+    }
+  };
+  bool pretenuring;
+  std::unordered_map<Site, uint32_t, SiteHash> siteIds;
+  std::vector<SiteStats> sites;
+  std::unordered_set<Object*> outbound;
+  int maxObjects;
+  size_t maxBytes;
+  int deferrals;
+  unsigned seed;
+  Coordinator &coordinator;
+};
+
+typedef BasicVM<> VM;
+
+inline unsigned Coordinator::attach(Tenant *vm) {
+  std::lock_guard<std::mutex> guard(lock);
+  vms.push_back(vm);
+  vm->lease = budget ? 0 : INT_MAX;
+  return (attached++ + 1) * 2654435761u;
+}
+
+inline void Coordinator::detach(Tenant *vm) {
+  std::lock_guard<std::mutex> guard(lock);
+  vms.erase(std::find(vms.begin(), vms.end(), vm));
+  if (budget) {
+    leased -= vm->lease;
+  }
+}
+
+/* Leases grow by half again each time, like the collection threshold.
+   Anyone still within their fair share is granted it outright; the
+   others have to go and collect first unless forced. */
+inline bool Coordinator::extend(Tenant &vm, bool force) {
+  std::lock_guard<std::mutex> guard(lock);
+  int want = std::max(vm.lease / 2, MAX_BARRIER);
+  int shortage = leased + want - budget;
+  if (shortage > 0) {
+    requestCollections(vm, shortage);
+    if (vm.lease + want > quota() && !force) {
+      return false;
+    }
+  }
+  vm.lease += want;
+  leased += want;
+  return true;
+}
+
+/* After a collection a VM hands back whatever it no longer needs,
+   keeping its live objects plus some headroom. */
+inline void Coordinator::settle(Tenant &vm) {
+  if (!budget) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  int keep = std::min(vm.lease, vm.numObjects + std::max(vm.numObjects / 2, MAX_BARRIER));
+  leased -= vm.lease - keep;
+  vm.lease = keep;
+}
+
+/* Most garbage first, judged by how far each VM has grown since its
+   last collection left it with only live objects. */
+inline void Coordinator::requestCollections(Tenant &except, int shortage) {
+  std::vector<Tenant*> victims;
+  for (Tenant *vm : vms) {
+    if (vm != &except && !vm->requested && vm->growth > 0) {
+      victims.push_back(vm);
+    }
+  }
+  std::sort(victims.begin(), victims.end(), [](Tenant *a, Tenant *b) {
+      return a->growth > b->growth;
+    });
+  for (Tenant *vm : victims) {
+    if (shortage <= 0) {
+      break;
+    }
+    vm->requested = true;
+    shortage -= vm->growth;
+  }
+}
+
+class HandleScope {
+public:
+  template<class VM> HandleScope(VM &vm): table(vm.handles), top(table.enter()) {};
+
+  ~HandleScope() {
+    table.exit(top);
+  }
+
+  HandleScope(const HandleScope&) = delete;
+  HandleScope& operator=(const HandleScope&) = delete;
+
+private:
+  HandleTable &table;
+  size_t top;
+};
+
+/* Handles are cheap to copy; copies share a slot, and all of them are
+   good until the innermost scope open when it was made closes. */
+class Handle {
+public:
+  template<class VM> Handle(VM &vm, Object *o): slot(vm.handles.allocate(o)) {};
+
+  Object* get() const {
+    return *slot;
+  }
+
+  Object* operator->() const {
+    return *slot;
+  }
+
+  Object& operator*() const {
+    return **slot;
+  }
+
+private:
+  Object** slot;
+};
+
+
+void test1() {
+  std::cout << "Test 1: Objects on stack are preserved." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.push(2);
+  vm.collect();
+  my_assert(vm.numObjects == 2, "Should have preserved objects.");
+}
+
+void test2() {
+  std::cout << "Test 2: Unreached objects are collected." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.push(2);
+  vm.pop();
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Should have collected objects.");
+
+}
+    
+void test3() {
+  std::cout << "Test 3: Reach nested objects." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.push(2);
+  vm.push();
+  vm.push(3);
+  vm.push(4);
+  vm.push();
+  vm.push();
+  vm.collect();
+  my_assert(vm.numObjects == 7, "Should have reached objects.");
+}
+
+/* see: "Everything you need to know about std::variant from C++17, by Bartłomiej Filipek
+         https://www.bfilipek.com/2018/06/variant.html
+   Bartek says:
+
+   "Those two lines look like a bit of magic :) But all they do is they
+   create a struct that inherits all given lambdas and uses their
+   Ts::operator(). The whole structure can be now passed to std::visit."
+
+   As I understand it, the ellipsis there is the "Parameter Pack"
+   operator, used to define variadic types.  
+
+*/         
+
+template<class... Ts> struct overload : Ts... { using Ts::operator()...; };
+template<class... Ts> overload(Ts...) -> overload<Ts...>;
+
+/* This was a constructor-style visitor built with overload; the
+   benchmark at the bottom still uses one to race std::visit against a
+   plain index check. */
+void tail_setter(decltype(Object::value) &c, Object *tail) {
+  if (Object::Pair* p = std::get_if<Object::Pair>(&c)) {
+    p->tail = tail;
+  }
+}
+
+void test4() {
+  std::cout << "Test 4: Handle cycles." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.push(2);
+  Object* a = vm.push();
+  vm.push(3);
+  vm.push(4);
+  Object* b = vm.push();
+  
+  
+  tail_setter(a->value, b);
+  tail_setter(b->value, a);
+  vm.collect();
+  my_assert(vm.numObjects == 4, "Should have collected objects.");
+}
+
+void test5() {
+  std::cout << "Test 5: Collections are staggered and deferred." << std::endl;
+  Coordinator coordinator(1);
+  VM a(coordinator), b(coordinator), c(coordinator), d(coordinator);
+  my_assert(a.threshold() != b.threshold() || b.threshold() != c.threshold()
+            || c.threshold() != d.threshold(), "Thresholds should be jittered.");
+
+  /* Pretend some other VM is collecting; this one should wait its turn
+     a couple of times, then go ahead regardless. */
+  coordinator.beginCollection(false);
+  int start = a.threshold();
+  for (int i = 0; i <= start; i++) {
+    a.push(i);
+  }
+  my_assert(a.numObjects == start + 1, "Should have deferred the collection.");
+  my_assert(a.threshold() > start, "Should have pushed the threshold out.");
+
+  for (int i = 0; i < 3 * start; i++) {
+    a.push(i);
+  }
+  my_assert(a.threshold() > a.numObjects, "Should have collected after deferring.");
+  coordinator.endCollection();
+}
+
+void test6() {
+  std::cout << "Test 6: A shared budget collects the most garbage first." << std::endl;
+  Coordinator coordinator(MAX_CONCURRENT, 96);
+  VM a(coordinator), b(coordinator), c(coordinator);
+
+  /* a builds up a pile of garbage, c sits idle, and b is all live data
+     growing past its share. */
+  for (int i = 0; i < 40; i++) {
+    a.push(i);
+  }
+  for (int i = 0; i < 40; i++) {
+    a.pop();
+  }
+  for (int i = 0; i < 60 && !a.collectionRequested(); i++) {
+    b.push(i);
+  }
+  my_assert(a.collectionRequested(), "Should have asked the biggest VM to collect.");
+  my_assert(!c.collectionRequested(), "Should have left the idle VM alone.");
+
+  a.safepoint();
+  my_assert(!a.collectionRequested() && a.numObjects == 0, "Should have collected on request.");
+}
+
+void test7() {
+  std::cout << "Test 7: The stack grows, and frames pop whole." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.pushFrame();
+  for (int i = 0; i < 10 * STACK_SEGMENT; i++) {
+    vm.push(i);
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 10 * STACK_SEGMENT + 1, "Should have kept the deep stack.");
+
+  vm.popFrame();
+  my_assert(vm.depth() == 1, "Should have popped the whole frame.");
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should have collected the frame.");
+}
+
+void test8() {
+  std::cout << "Test 8: Minor collections rescan only what moved." << std::endl;
+  VM vm;
+  vm.setSticky(true);
+  for (int i = 0; i < 1000; i++) {
+    vm.push(i);
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 1000, "Should have kept the old objects.");
+
+  vm.pop();
+  vm.push(1);
+  vm.push(2);
+  Object* pair = vm.push();
+  vm.push(3);
+  vm.pop();
+  vm.rootsScanned = 0;
+  vm.minorCollect();
+  my_assert(vm.rootsScanned == 1, "Should only have rescanned above the watermark.");
+  my_assert(vm.numObjects == 1003, "Should have collected young garbage only.");
+
+  /* The pair is old now, and below the watermark; point it at
+     something young that nothing else holds. */
+  vm.push(4);
+  vm.setTail(pair, vm.pop());
+  vm.push(5);
+  vm.pop();
+  vm.minorCollect();
+  my_assert(vm.numObjects == 1004, "Should have kept the remembered object.");
+
+  vm.collect();
+  my_assert(vm.numObjects == 1002, "Should have collected old garbage on a full collection.");
+}
+
+void test9() {
+  std::cout << "Test 9: Every task's stack is a root." << std::endl;
+  VM vm;
+  vm.setSticky(true);
+  int tasks[100];
+  for (int i = 0; i < 100; i++) {
+    tasks[i] = vm.createTask();
+    vm.switchTask(tasks[i]);
+    vm.push(i);
+    vm.push(i);
+  }
+  vm.switchTask(0);
+  vm.collect();
+  my_assert(vm.numObjects == 200, "Should have kept every task's objects.");
+
+  /* Only the task we touch gets rescanned. */
+  vm.switchTask(tasks[7]);
+  vm.pop();
+  vm.push(7);
+  vm.rootsScanned = 0;
+  vm.minorCollect();
+  my_assert(vm.rootsScanned == 1, "Should only have rescanned the dirty task.");
+  my_assert(vm.numObjects == 201, "Should have kept the new object.");
+
+  vm.switchTask(0);
+  for (int i = 0; i < 50; i++) {
+    vm.destroyTask(tasks[i]);
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 100, "Should have collected the destroyed tasks' objects.");
+  my_assert(vm.createTask() == tasks[49], "Should have reused a task id.");
+}
+
+void test10() {
+  std::cout << "Test 10: Handles keep objects off the stack alive." << std::endl;
+  VM vm;
+  {
+    HandleScope scope(vm);
+    Handle h(vm, vm.push(1));
+    vm.pop();
+    for (int i = 0; i < 1000; i++) {
+      vm.push(i);
+      vm.pop();
+    }
+    vm.collect();
+    my_assert(vm.numObjects == 1, "Should have kept the handled object.");
+    my_assert(std::get<int>(h->value) == 1, "Should still be able to read it.");
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Should have released the handle with its scope.");
+}
+
+void test11() {
+  std::cout << "Test 11: Conservative scanning finds native locals." << std::endl;
+  VM vm;
+  vm.setConservative(true);
+  Object* volatile kept = vm.push(1);
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should have found the local.");
+  my_assert(std::get<int>(kept->value) == 1, "Should still be able to read it.");
+}
+
+void test12() {
+  std::cout << "Test 12: Small integers don't allocate." << std::endl;
+  VM vm;
+  vm.setImmediateInts(true);
+  vm.push(1);
+  vm.push(-2);
+  Object* pair = vm.push();
+  vm.push(INT_MAX / 2);
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should only have allocated the pair.");
+
+  Object::Pair &p = std::get<Object::Pair>(pair->value);
+  my_assert(Object::toInt(p.head) == 1 && Object::toInt(p.tail) == -2,
+            "Should have kept the immediates in the pair.");
+  my_assert(Object::toInt(vm.pop()) == INT_MAX / 2, "Should round-trip through the stack.");
+}
+
+void test13() {
+  std::cout << "Test 13: Sweeping hands back empty chunks." << std::endl;
+  VM vm;
+  for (size_t i = 0; i < 4 * CHUNK_CELLS; i++) {
+    vm.push(i);
+  }
+  my_assert(vm.heapChunks() >= 4, "Should have needed several chunks.");
+  for (size_t i = 0; i < 4 * CHUNK_CELLS - 1; i++) {
+    vm.pop();
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should have kept the bottom object.");
+  my_assert(vm.heapChunks() == 1, "Should have released the empty chunks.");
+  my_assert(std::get<int>(vm.pop()->value) == 0, "Should have left it intact.");
+}
+
+void test14() {
+  std::cout << "Test 14: References survive compression." << std::endl;
+  VM vm;
+  Object* o = vm.push(1);
+  Ref pointer = o;
+  Ref null = NULL;
+  Ref small = Object::immediate(-5);
+  my_assert((Object*) pointer == o, "Should round-trip a pointer.");
+  my_assert((Object*) null == NULL, "Should round-trip null.");
+  my_assert(Object::toInt(small) == -5, "Should round-trip an immediate.");
+#ifdef COMPRESSED_REFS
+  my_assert(sizeof(Ref) == 4 && sizeof(Object::Pair) == 8, "Should have halved the fields.");
+#endif
+}
+
+void test15() {
+  std::cout << "Test 15: Integers live apart from pairs." << std::endl;
+  VM vm;
+  Object* one = vm.push(1);
+  vm.push(2);
+  Object* pair = vm.push();
+  my_assert(Heap::isLeaf(one) && !Heap::isLeaf(pair), "Should have segregated the integer.");
+
+  for (int i = 0; i < 1000; i++) {
+    vm.push(i);
+    vm.push(i);
+    vm.push();
+    vm.pop();
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 3, "Should have swept both spaces.");
+  my_assert(std::get<int>(one->value) == 1, "Should have kept the leaf intact.");
+}
+
+/* Every policy swapped out at once. */
+typedef BasicVM<BumpAllocator, BreadthFirstTracer, LazySweeper, DoublingTrigger, NoBarrier> LeanVM;
+
+void test16() {
+  std::cout << "Test 16: Other policies collect the same." << std::endl;
+  LeanVM vm;
+  vm.push(1);
+  vm.push(2);
+  vm.push();
+  vm.push(3);
+  vm.push(4);
+  vm.push();
+  vm.push();
+  vm.collect();
+  my_assert(vm.numObjects == 7, "Should have reached objects.");
+  my_assert(vm.threshold() == 14, "Should have doubled without jitter.");
+
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Should have collected objects.");
+
+  for (int i = 0; i < 10000; i++) {
+    vm.push(i);
+    vm.pop();
+  }
+  my_assert(vm.heapChunks() <= 2, "Should have reused the swept chunks.");
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Should have collected the churn.");
+}
+
+void test17() {
+  std::cout << "Test 17: Blobs keep their stores, large or small." << std::endl;
+  VM vm;
+  Object* small = vm.pushBlob(100);
+  Object* big = vm.pushBlob(1 << 20);
+  std::get<Object::Blob>(small->value).data()[99] = 'x';
+  std::get<Object::Blob>(big->value).data()[(1 << 20) - 1] = 'y';
+  vm.collect();
+  my_assert(vm.largeStores() == 2 && vm.largeBytes() == 100 + (1 << 20), "Should have kept both stores.");
+  my_assert(std::get<Object::Blob>(small->value).data()[99] == 'x' &&
+            std::get<Object::Blob>(big->value).data()[(1 << 20) - 1] == 'y',
+            "Should have left the bytes alone.");
+
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 1 && vm.largeStores() == 1, "Should have released the big store.");
+  vm.pop();
+  vm.collect();
+  my_assert(vm.largeStores() == 0 && vm.largeBytes() == 0, "Should have released the small store.");
+}
+
+void test18() {
+  std::cout << "Test 18: Vectors hold their elements." << std::endl;
+  VM vm;
+  const size_t n = 10000;
+  for (size_t i = 0; i < n; i++) {
+    vm.push(i);
+  }
+  Object* vector = vm.pushVector(n);
+  my_assert(vm.depth() == 1, "Should have popped the elements.");
+  vm.collect();
+  my_assert(vm.numObjects == n + 1, "Should have reached every element.");
+
+  Object::Vector &v = std::get<Object::Vector>(vector->value);
+  my_assert(v.size() == n && std::get<int>(v.elements()[0]->value) == 0 &&
+            std::get<int>(v.elements()[n - 1]->value) == (int) n - 1,
+            "Should have kept the elements in order.");
+
+  vm.push(-1);
+  vm.setElement(vector, n - 1, vm.pop());
+  vm.collect();
+  my_assert(vm.numObjects == n + 1, "Should have dropped the replaced element.");
+  my_assert(std::get<int>(v.elements()[n - 1]->value) == -1, "Should have kept the new one.");
+
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 0 && vm.largeStores() == 0, "Should have collected the vector.");
+}
+
+void test19() {
+  std::cout << "Test 19: Equal strings share a store after collection." << std::endl;
+  VM vm;
+  Object* a = vm.pushString("key");
+  Object* b = vm.pushString("key");
+  vm.pushString("other");
+  my_assert(vm.largeStores() == 3, "Should have started with a store each.");
+  vm.collect();
+  my_assert(vm.numObjects == 3 && vm.largeStores() == 2, "Should have merged the copies.");
+
+  const Object::String &sa = std::get<Object::String>(a->value);
+  const Object::String &sb = std::get<Object::String>(b->value);
+  my_assert(sa.data() == sb.data(), "Should share the bytes.");
+  my_assert(std::string(sb.data(), sb.size()) == "key", "Should have kept the contents.");
+
+  vm.pop();
+  vm.pop();
+  vm.collect();
+  my_assert(vm.largeStores() == 1 && std::string(sa.data(), sa.size()) == "key",
+            "Should have kept the shared store for the survivor.");
+}
+
+void test20() {
+  std::cout << "Test 20: Shared pairs are built once." << std::endl;
+  VM vm;
+  vm.setImmediateInts(true);
+  vm.push(1);
+  vm.push(2);
+  Object* a = vm.consShared();
+  vm.push(3);
+  Object* outer = vm.consShared();
+
+  vm.push(1);
+  vm.push(2);
+  my_assert(vm.consShared() == a, "Should have found the inner pair.");
+  vm.push(3);
+  my_assert(vm.consShared() == outer, "Should have found the outer pair.");
+  my_assert(vm.numObjects == 2, "Should only have built two pairs.");
+
+  vm.push(1);
+  vm.push(2);
+  my_assert(vm.push() != a, "Should build a fresh pair when not asked to share.");
+
+  vm.pop();
+  vm.pop();
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Shared pairs should be held weakly.");
+  vm.push(1);
+  vm.push(2);
+  vm.consShared();
+  my_assert(vm.numObjects == 1, "Should have built it again.");
+}
+
+void test21() {
+  std::cout << "Test 21: Weak references don't keep their targets." << std::endl;
+  VM vm;
+  Object* weak;
+  {
+    HandleScope scope(vm);
+    Handle target(vm, vm.push(1));
+    weak = vm.pushWeak();
+    vm.collect();
+    my_assert(vm.numObjects == 2, "Should have kept the target through the handle.");
+    my_assert((Object*) std::get<Object::Weak>(weak->value).target == target.get(),
+              "Should still point at a live target.");
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should have collected the target.");
+  my_assert((Object*) std::get<Object::Weak>(weak->value).target == NULL,
+            "Should have cleared the weak reference.");
+}
+
+void test22() {
+  std::cout << "Test 22: Ephemeron tables hold values only through live keys." << std::endl;
+  VM vm;
+  Object* table = vm.pushTable();
+  Object* key = vm.push(1);
+  vm.push(2);
+  Object* value = vm.pop();
+  vm.push(3);
+  Object* chained = vm.pop();
+  vm.push(4);
+  Object* deadKey = vm.pop();
+  vm.push(5);
+  Object* deadValue = vm.pop();
+  vm.tablePut(table, key, value);
+  vm.tablePut(table, value, chained);
+  vm.tablePut(table, deadKey, deadValue);
+  my_assert(vm.tableGet(table, deadKey) == deadValue, "Should have stored the entry.");
+
+  vm.collect();
+  my_assert(vm.numObjects == 4, "Should have followed the chain and dropped the dead key.");
+  my_assert(vm.tableGet(table, key) == value && vm.tableGet(table, value) == chained,
+            "Should have kept the live entries.");
+  my_assert(std::get<Object::Table>(table->value).count() == 2, "Should have removed the dead entry.");
+
+  vm.pop();
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should have collected the whole chain.");
+  my_assert(std::get<Object::Table>(table->value).count() == 0, "Should have emptied the table.");
+
+  for (int i = 0; i < 100; i++) {
+    vm.tablePut(table, Object::immediate(i), Object::immediate(-i));
+  }
+  vm.collect();
+  my_assert(Object::toInt(vm.tableGet(table, Object::immediate(99))) == -99,
+            "Should have grown and kept immediate keys.");
+}
+
+template<typename V> void finalizeDeadObjects() {
+  std::atomic<int> finalized(0);
+  {
+    V vm;
+    Object* kept = vm.push(1);
+    vm.setFinalizer(kept, [&finalized] { finalized += 1; });
+    vm.push(2);
+    vm.push(3);
+    vm.setFinalizer(vm.push(), [&finalized] { finalized += 10; });
+    vm.pop();
+    vm.collect();
+    vm.waitForFinalizers();
+    my_assert(finalized == 10, "Should have finalized only the dead pair.");
+    vm.collect();
+    vm.waitForFinalizers();
+    my_assert(finalized == 10, "Should have finalized it only once.");
+  }
+  my_assert(finalized == 11, "Should have finalized the survivor with the VM.");
+}
+
+void test23() {
+  std::cout << "Test 23: Dead objects are finalized off the collector's thread." << std::endl;
+  finalizeDeadObjects<VM>();
+  finalizeDeadObjects<LeanVM>();
+}
+
+void test24() {
+  std::cout << "Test 24: Reference counting frees garbage promptly." << std::endl;
+  VM vm;
+  vm.setRefCounting(true);
+  vm.push(1);
+  vm.push(2);
+  vm.push();
+  vm.pop();
+  vm.flushCounts();
+  my_assert(vm.numObjects == 0, "Should have freed the pair and what it held.");
+
+  vm.push(1);
+  vm.push(2);
+  Object* a = vm.push();
+  vm.push(3);
+  vm.push(4);
+  Object* b = vm.push();
+  vm.setTail(a, b);
+  vm.setTail(b, a);
+  vm.flushCounts();
+  my_assert(vm.numObjects == 4, "Should have kept the stack's objects.");
+  vm.pop();
+  vm.pop();
+  vm.flushCounts();
+  my_assert(vm.numObjects == 4, "Counting alone can't free a cycle.");
+  vm.collect();
+  my_assert(vm.numObjects == 0, "The backup collection should free the cycle.");
+
+  vm.push(0);
+  for (int i = 0; i < 100000; i++) {
+    vm.push(i);
+    vm.push();
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 2 * 100000 + 1, "Should have kept the list after recounting.");
+  vm.pop();
+  vm.flushCounts();
+  my_assert(vm.numObjects == 0, "Should have freed the whole list in one batch.");
+  int before = vm.threshold();
+  for (int i = 0; i < 100000; i++) {
+    vm.push(i);
+    vm.pop();
+  }
+  my_assert(vm.threshold() == before, "Should have kept up without collecting.");
+}
+
+void test25() {
+  std::cout << "Test 25: Regions are freed whole unless something escapes." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.push(2);
+  Object* outer = vm.push();
+
+  vm.enterRegion();
+  for (int i = 0; i < 1000; i++) {
+    vm.push(i);
+    vm.push(i);
+    vm.push();
+    vm.pop();
+  }
+  my_assert(vm.exitRegion(), "Nothing should have escaped.");
+  my_assert(vm.numObjects == 3, "Should have freed the region's objects.");
+
+  vm.enterRegion();
+  vm.push(3);
+  vm.push(4);
+  Object* kept = vm.push();
+  my_assert(!vm.exitRegion(), "The stack should have kept the pair.");
+  vm.collect();
+  my_assert(vm.numObjects == 6, "Should have promoted the region.");
+  my_assert(std::get<int>(std::get<Object::Pair>(kept->value).head->value) == 3,
+            "Should have left the promoted pair intact.");
+  vm.pop();
+
+  vm.enterRegion();
+  vm.push(5);
+  vm.setHead(outer, vm.pop());
+  my_assert(!vm.exitRegion(), "The write barrier should have seen the escape.");
+  vm.collect();
+  my_assert(vm.numObjects == 3, "Should have kept the escaped integer in place of the old head.");
+  my_assert(std::get<int>(std::get<Object::Pair>(outer->value).head->value) == 5,
+            "Should have kept the escaped value.");
+
+  BasicVM<PoolAllocator, DepthFirstTracer, LazySweeper, DoublingTrigger> lazy;
+  int finalized = 0;
+  lazy.enterRegion();
+  for (int i = 0; i < 100; i++) {
+    lazy.setFinalizer(lazy.push(i), [&finalized]() { finalized++; });
+    lazy.pop();
+  }
+  lazy.collect();
+  my_assert(lazy.exitRegion(), "Nothing should have escaped the lazy region.");
+  lazy.waitForFinalizers();
+  my_assert(lazy.numObjects == 0, "Shouldn't have counted the lazily swept dead twice.");
+  my_assert(finalized == 100, "Should have finalized each object once.");
+}
+
+void test26() {
+  std::cout << "Test 26: Released temporaries are reused without collecting." << std::endl;
+  VM vm;
+  int settled = 0;
+  for (int i = 0; i < 1000; i++) {
+    for (int j = 0; j < 20; j++) {
+      vm.push(i);
+    }
+    for (int k = 0; k < 20; k++) {
+      vm.release(vm.pop());
+    }
+    settled = i ? settled : vm.threshold();
+  }
+  my_assert(vm.numObjects == 0 && vm.threshold() == settled, "Should never have needed another collection.");
+  my_assert(vm.heapChunks() == 1, "Should have reused the released cells.");
+
+  vm.push(1);
+  vm.push(2);
+  vm.push();
+  vm.release(vm.pop());
+  my_assert(vm.numObjects == 2, "Should only have freed the pair itself.");
+  vm.collect();
+  my_assert(vm.numObjects == 0, "Should have collected what it held.");
+
+  BasicVM<BumpAllocator> bumping;
+  for (int i = 0; i < 100000; i++) {
+    bumping.push(i);
+    bumping.release(bumping.pop());
+  }
+  for (int i = 0; i < 100000; i++) {
+    bumping.push(i);
+    bumping.push(i);
+    Object* b = bumping.pop();
+    bumping.release(bumping.pop());
+    bumping.release(b);
+  }
+  my_assert(bumping.numObjects == 0 && bumping.heapChunks() == 1,
+            "Should have bumped back down over the released cells.");
+}
+
+void test27() {
+  std::cout << "Test 27: Sites whose objects survive are pretenured." << std::endl;
+  VM vm;
+  vm.setSticky(true);
+  vm.setPretenuring(true);
+  /* One to a line: a site is a file and a line. */
+  Site lasting;
+  Site fleeting;
+  Site pairs;
+  for (int i = 0; i < 100; i++) {
+    vm.push(i, lasting);
+    vm.push(i, fleeting);
+    vm.pop();
+  }
+  vm.minorCollect();
+  my_assert(vm.isPretenured(lasting) && !vm.isPretenured(fleeting),
+            "Should have told the two sites apart.");
+  my_assert(Heap::isMarked(vm.push(7, lasting)), "Should be born old.");
+  my_assert(!Heap::isMarked(vm.push(8, fleeting)), "Should be born young.");
+
+  for (int i = 0; i < 100; i++) {
+    vm.push(i, fleeting);
+    vm.push(i, fleeting);
+    vm.push(pairs);
+  }
+  vm.minorCollect();
+  my_assert(vm.isPretenured(pairs), "Should have pretenured the pairs.");
+
+  int before = vm.numObjects;
+  vm.push(1, fleeting);
+  vm.push(2, fleeting);
+  Object* pair = vm.push(pairs);
+  my_assert(Heap::isMarked(pair), "Should have allocated the pair old.");
+  vm.minorCollect();
+  vm.minorCollect();
+  my_assert(vm.numObjects == before + 3, "Should have kept the old pair's young fields.");
+  Object::Pair &p = std::get<Object::Pair>(pair->value);
+  my_assert(std::get<int>(p.head->value) == 1 && std::get<int>(p.tail->value) == 2,
+            "Should have left them intact.");
+}
+
+void test28() {
+  std::cout << "Test 28: Frozen objects are neither traced nor swept." << std::endl;
+  VM vm;
+  for (int i = 0; i < 1000; i++) {
+    vm.push(i);
+  }
+  vm.push(0);
+  for (int i = 0; i < 1000; i++) {
+    vm.push();
+  }
+  vm.pushString("configuration");
+  vm.push();
+  Object* list = vm.pop();
+  vm.freeze(list);
+  my_assert(vm.isFrozen(list) && vm.numObjects == 2003, "Should have frozen the whole list.");
+
+  vm.collect();
+  my_assert(vm.numObjects == 2003 && vm.largeStores() == 1, "Should have kept the list with no roots.");
+  Object::Pair* head = std::get_if<Object::Pair>(&list->value);
+  Object::Pair* first = std::get_if<Object::Pair>(&head->head->value);
+  my_assert(std::get<int>(first->head->value) == 0 && head->tail->kind() == Object::STRING,
+            "Should have left it intact.");
+
+  vm.push(12345);
+  vm.setHead(list, vm.pop());
+  vm.collect();
+  vm.collect();
+  my_assert(vm.numObjects == 2004, "Should have traced what the frozen pair was given.");
+  my_assert(std::get<int>(head->head->value) == 12345, "Should have kept the new head.");
+  my_assert(!vm.isFrozen(head->head), "Shouldn't have frozen the new head.");
+
+  vm.setSticky(true);
+  vm.push(54321);
+  vm.setHead(list, vm.pop());
+  vm.minorCollect();
+  vm.collect();
+  my_assert(vm.numObjects == 2004, "Should have dropped the old head.");
+  my_assert(std::get<int>(head->head->value) == 54321, "Should have kept it in sticky mode too.");
+}
+
+void test29() {
+  std::cout << "Test 29: Lazy sweeping spares objects allocated since." << std::endl;
+  BasicVM<PoolAllocator, DepthFirstTracer, LazySweeper, DoublingTrigger> vm;
+  for (size_t i = 0; i < 3 * CHUNK_CELLS; i++) {
+    vm.push(i);
+  }
+  for (size_t i = 0; i < 3 * CHUNK_CELLS; i++) {
+    vm.pop();
+  }
+  vm.collect();
+  my_assert(vm.heapChunks() >= 3, "Should have left the chunks to be swept.");
+  Object* a = vm.push(111);
+  Object* b = vm.push(222);
+  vm.collect();
+  for (int i = 0; i < 10; i++) {
+    vm.push(333);
+  }
+  vm.collect();
+  my_assert(vm.numObjects == 12, "Should have kept them all.");
+  my_assert(std::get<int>(a->value) == 111 && std::get<int>(b->value) == 222,
+            "Shouldn't have handed out their cells again.");
+}
+
+void test30() {
+  std::cout << "Test 30: Popping past a frame closes it." << std::endl;
+  VM vm;
+  vm.push(1);
+  vm.pushFrame();
+  for (int i = 0; i < 4 * STACK_SEGMENT; i++) {
+    vm.push(i);
+  }
+  vm.pushFrame();
+  for (int i = 0; i < 4 * STACK_SEGMENT; i++) {
+    vm.pop();
+  }
+  vm.popFrame();
+  my_assert(vm.depth() == 1, "Shouldn't have brought popped slots back.");
+  vm.collect();
+  my_assert(vm.numObjects == 1, "Should only have kept what's left on the stack.");
+}
+
+void test31() {
+  std::cout << "Test 31: Large stores count toward collecting." << std::endl;
+  VM vm;
+  for (int i = 0; i < 1000; i++) {
+    vm.push(i);
+  }
+  size_t most = 0;
+  for (int i = 0; i < 1000; i++) {
+    vm.pushBlob(1 << 20);
+    vm.pop();
+    most = std::max(most, vm.largeBytes());
+  }
+  my_assert(most <= 2 * LARGE_TRIGGER, "Should have collected the dead blobs as it went.");
+  vm.collect();
+  my_assert(vm.numObjects == 1000 && vm.largeBytes() == 0, "Should have kept only the ints.");
+}
+
+void test32() {
+  std::cout << "Test 32: Going conservative inside a region keeps the region." << std::endl;
+  VM vm;
+  vm.enterRegion();
+  vm.push(1);
+  vm.pop();
+  vm.setConservative(true);
+  my_assert(!vm.exitRegion(), "A native local might still point into the region.");
+  my_assert(vm.numObjects == 1, "Should have adopted the region's objects.");
+  vm.setConservative(false);
+  vm.enterRegion();
+  vm.push(2);
+  vm.pop();
+  my_assert(vm.exitRegion(), "Should have freed the next region.");
+}
+
+void perfTest() {
+  std::cout << "Performance Test." << std::endl;
+  VM vm;
+
+  for (int i = 0; i < 1000; i++) {
+    for (int j = 0; j < 20; j++) {
+      vm.push(i);
+    }
+
+    for (int k = 0; k < 20; k++) {
+      vm.pop();
+    }
+  }
+}
+
+/* How fast can the mark loop go, depending on how Object's value is
+   spelled?  Each contender builds the same graph, a third integers and
+   the rest pairs pointing back at earlier nodes, and marks it from the
+   same roots with the same explicit mark stack.  Only the
+   representation and the way the loop asks "is this a pair?" differ.
+   A small graph that sits in cache shows the cost of the dispatch; a
+   big one shows how much that matters once every node is a miss.
+   Build optimized and run "collector bench" to see it.
+
+   On gcc 12 at -O2, std::variant came out within run-to-run noise of
+   a hand-rolled tagged union at both sizes, and ahead of
+   mapbox::util::variant in cache, whose size_t index makes every node
+   a word bigger.  So Object stays a
+   std::variant, and VM::mark switches on its index(). */
+
+namespace bench {
+
+const int PASSES = 20;
+
+struct StdNode {
+  struct Pair { StdNode *head, *tail; };
+  StdNode(int v): value(v) {}
+  StdNode(StdNode *h, StdNode *t): value(Pair{h, t}) {}
+  std::variant<int, Pair> value;
+
+  const Pair* pair() const {
+    return value.index() == 1 ? std::get_if<1>(&value) : NULL;
+  }
+};
+
+struct MapboxNode {
+  struct Pair { MapboxNode *head, *tail; };
+  MapboxNode(int v): value(v) {}
+  MapboxNode(MapboxNode *h, MapboxNode *t): value(Pair{h, t}) {}
+  mapbox::util::variant<int, Pair> value;
+
+  const Pair* pair() const {
+    return value.which() == 1 ? &value.get_unchecked<Pair>() : NULL;
+  }
+};
+
+struct TaggedNode {
+  struct Pair { TaggedNode *head, *tail; };
+  TaggedNode(int v): tag(INT), i(v) {}
+  TaggedNode(TaggedNode *h, TaggedNode *t): tag(PAIR), pair_{h, t} {}
+  enum Tag : unsigned char { INT, PAIR } tag;
+  union {
+    int i;
+    Pair pair_;
+  };
+
+  const Pair* pair() const {
+    return tag == PAIR ? &pair_ : NULL;
+  }
+};
+
+template<typename Node> struct Graph {
+  Graph(size_t size) {
+    unsigned seed = 12345;
+    nodes.reserve(size);
+    for (size_t i = 0; i < size; i++) {
+      seed = seed * 1103515245 + 12345;
+      if (i < 2 || i % 3 == 0) {
+        nodes.emplace_back((int) i);
+      } else {
+        nodes.emplace_back(&nodes[seed % i], &nodes[i - 1]);
+      }
+    }
+    for (size_t i = size - 64; i < size; i++) {
+      roots.push_back(&nodes[i]);
+    }
+    marks.resize(size);
+  }
+
+  /* The tag-switch loop, which is what VM::mark does. */
+  size_t mark() {
+    std::fill(marks.begin(), marks.end(), 0);
+    size_t n = 0;
+    work.assign(roots.begin(), roots.end());
+    while (!work.empty()) {
+      Node* o = work.back();
+      work.pop_back();
+      if (marks[o - nodes.data()]++) {
+        continue;
+      }
+      n++;
+      if (auto p = o->pair()) {
+        work.push_back(p->tail);
+        work.push_back(p->head);
+      }
+    }
+    return n;
+  }
+
+  /* The same loop with std::visit doing the dispatch, the way the
+     collector used to. */
+  size_t visit() {
+    std::fill(marks.begin(), marks.end(), 0);
+    size_t n = 0;
+    work.assign(roots.begin(), roots.end());
+    while (!work.empty()) {
+      Node* o = work.back();
+      work.pop_back();
+      if (marks[o - nodes.data()]++) {
+        continue;
+      }
+      n++;
+      std::visit(overload{
+          [](int) {},
+          [this](const typename Node::Pair &p) {
+            work.push_back(p.tail);
+            work.push_back(p.head);
+          }
+        }, o->value);
+    }
+    return n;
+  }
+
+  std::vector<Node> nodes;
+  std::vector<Node*> roots;
+  std::vector<Node*> work;
+  std::vector<unsigned char> marks;
+};
+
+/* Best of PASSES, in nanoseconds per object marked. */
+template<typename F> double time(F f) {
+  double best = 1e30;
+  for (int i = 0; i < PASSES; i++) {
+    auto start = std::chrono::steady_clock::now();
+    size_t n = f();
+    std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+    best = std::min(best, took.count() / n);
+  }
+  return best;
+}
+
+}
+
+/* Allocation churn through whole VMs, in nanoseconds per push. */
+template<typename V> double churn() {
+  return bench::time([] {
+      V vm;
+      for (int i = 0; i < 1000; i++) {
+        for (int j = 0; j < 20; j++) {
+          vm.push(i);
+          if (j % 2) {
+            vm.push();
+          }
+        }
+        vm.pop();
+        vm.pop();
+      }
+      return (size_t) 30000;
+    });
+}
+
+void benchmark() {
+  for (size_t size : { 1 << 14, 1 << 20 }) {
+    bench::Graph<bench::StdNode> std(size);
+    bench::Graph<bench::MapboxNode> mapbox(size);
+    bench::Graph<bench::TaggedNode> tagged(size);
+    std::cout << "Mark throughput over " << size << " nodes, ns per object:" << std::endl
+              << "  std::variant, std::visit     " << bench::time([&] { return std.visit(); }) << std::endl
+              << "  std::variant, tag switch     " << bench::time([&] { return std.mark(); }) << std::endl
+              << "  mapbox::util::variant        " << bench::time([&] { return mapbox.mark(); }) << std::endl
+              << "  hand-rolled tagged union     " << bench::time([&] { return tagged.mark(); }) << std::endl;
+  }
+  std::cout << "Allocation churn, ns per push:" << std::endl
+            << "  default policies             " << churn<VM>() << std::endl
+            << "  bump, lazy sweep             " << churn<BasicVM<BumpAllocator, DepthFirstTracer, LazySweeper>>() << std::endl
+            << "  bump, breadth first, lazy    " << churn<LeanVM>() << std::endl;
+}
+
+int main(int argc, const char * argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    benchmark();
+    return 0;
+  }
+
   test1();
   test2();
   test3();
   test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+  test25();
+  test26();
+  test27();
+  test28();
+  test29();
+  test30();
+  test31();
+  test32();
   perfTest();
 
   return 0;